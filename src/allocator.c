@@ -1,14 +1,13 @@
 #include "allocator.h"
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "maths.h"
 
-#define UINT32_DEADBEEF 0xDEADBEEF
-
 static const ptrdiff_t ARCH_ALIGNMENT = 2 * sizeof(void*);
 
 /* Heap based stack allocator */
@@ -57,6 +56,35 @@ static void arenaPop(Allocator allocator, void* allocation) {
   }
 }
 
+/* resizes in place when the allocation is the last one made from the
+ * arena, otherwise the contents move to a new allocation and the old
+ * one is left behind until the arena is popped below it
+ */
+static void* arenaRealloc(Allocator allocator, void* allocation,
+                          size_t old_size, size_t new_size) {
+  struct Arena* a = arenaHeader(allocator);
+  assert(a);
+
+  char* p = (char*)allocation;
+  if (p && p + old_size == a->offset) {
+    size_t available = a->end - p;
+    if (available < new_size) {
+      fprintf(stderr,
+              "ERR arenaRealloc: tried resizing to %zu only %zu left!\n",
+              new_size, available);
+      abort();
+    }
+    if (new_size > old_size) memset(p + old_size, 0, new_size - old_size);
+    a->offset = p + new_size;
+    return p;
+  }
+  if (p && new_size <= old_size) return p;
+
+  void* ret = arenaSuballoc(allocator, new_size);
+  if (p) memcpy(ret, p, old_size);
+  return ret;
+}
+
 Allocator arenaCreate(size_t size, Allocator host) {
   struct Arena* arena = NULL;
   if (!host) {
@@ -70,7 +98,8 @@ Allocator arenaCreate(size_t size, Allocator host) {
     abort();
   }
 
-  arena->vtable = (struct AllocatorVTable){arenaSuballoc, arenaPop};
+  arena->vtable =
+      (struct AllocatorVTable){arenaSuballoc, arenaPop, arenaRealloc};
   arena->beg = (char*)arena + sizeof(struct Arena);
   arena->offset = arena->beg;
   arena->end = arena->offset + size;
@@ -83,52 +112,333 @@ void arenaDestroy(Allocator a) {
   free(arena);
 }
 
+/*
+ * Thread local arenas
+ * every thread that allocates through the shared vtable is given
+ * its own arena on first use, threadArenaRelease() must be called
+ * by that thread before it exits
+ */
+static _Thread_local Allocator thread_arena_ = NULL;
+
+static inline Allocator threadArenaGet(void) {
+  if (!thread_arena_) thread_arena_ = arenaCreate(THREAD_ARENA_RAM_SIZE, NULL);
+  return thread_arena_;
+}
+
+static void* threadArenaSuballoc(Allocator allocator, size_t size) {
+  (void)allocator;
+  Allocator a = threadArenaGet();
+  return a->mallocFn(a, size);
+}
+
+static void threadArenaPop(Allocator allocator, void* allocation) {
+  (void)allocator;
+  Allocator a = threadArenaGet();
+  a->freeFn(a, allocation);
+}
+
+static void* threadArenaRealloc(Allocator allocator, void* allocation,
+                                size_t old_size, size_t new_size) {
+  (void)allocator;
+  Allocator a = threadArenaGet();
+  return a->reallocFn(a, allocation, old_size, new_size);
+}
+
+static struct AllocatorVTable THREAD_ARENA_VTABLE = {
+    threadArenaSuballoc, threadArenaPop, threadArenaRealloc};
+
+Allocator threadArenaAllocator(void) { return &THREAD_ARENA_VTABLE; }
+
+void threadArenaRelease(void) {
+  if (!thread_arena_) return;
+  arenaDestroy(thread_arena_);
+  thread_arena_ = NULL;
+}
+
+/*
+ * Lock-free pool of fixed size blocks
+ * free blocks form a stack of indices, the head packs the top index
+ * in its low 32 bits and a version tag in its high 32 bits so a
+ * compare-and-swap cannot succeed on a head that was popped and
+ * pushed back in between (ABA)
+ */
+#define POOL_NIL UINT32_MAX
+
+struct Pool {
+  struct AllocatorVTable vtable;
+  Allocator host;
+  size_t block_size;
+  size_t block_count;
+  _Atomic uint64_t head;
+  _Atomic uint32_t* next;
+  char* blocks;
+};
+
+static inline struct Pool* poolHeader(Allocator allocator_ptr) {
+  return container_of(allocator_ptr, struct Pool, vtable);
+}
+
+static inline uint64_t poolHeadPack(uint64_t old_head, uint32_t index) {
+  return (((old_head >> 32) + 1) << 32) | index;
+}
+
+static void* poolSuballoc(Allocator allocator, size_t size) {
+  struct Pool* p = poolHeader(allocator);
+  assert(p);
+
+  if (size > p->block_size) {
+    fprintf(stderr, "ERR poolSuballoc: tried allocating %zu blocks are %zu!\n",
+            size, p->block_size);
+    abort();
+  }
+
+  uint64_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+  uint64_t new_head;
+  do {
+    uint32_t top = (uint32_t)head;
+    if (top == POOL_NIL) {
+      fprintf(stderr, "ERR poolSuballoc: all %zu blocks in use!\n",
+              p->block_count);
+      abort();
+    }
+    uint32_t next = atomic_load_explicit(&p->next[top], memory_order_relaxed);
+    new_head = poolHeadPack(head, next);
+  } while (!atomic_compare_exchange_weak_explicit(
+      &p->head, &head, new_head, memory_order_acquire, memory_order_acquire));
+
+  void* block = p->blocks + (size_t)(uint32_t)head * p->block_size;
+  return memset(block, 0, size);
+}
+
+static void poolFree(Allocator allocator, void* allocation) {
+  struct Pool* p = poolHeader(allocator);
+  assert(p);
+
+  char* block = (char*)allocation;
+  ptrdiff_t offset = block - p->blocks;
+  if (!block || offset < 0 ||
+      (size_t)offset >= p->block_size * p->block_count ||
+      offset % p->block_size) {
+    printf("poolFree fail\n");
+    return;
+  }
+
+  uint32_t index = offset / p->block_size;
+  uint64_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    atomic_store_explicit(&p->next[index], (uint32_t)head,
+                          memory_order_relaxed);
+    new_head = poolHeadPack(head, index);
+  } while (!atomic_compare_exchange_weak_explicit(
+      &p->head, &head, new_head, memory_order_release, memory_order_relaxed));
+}
+
+/* blocks have a fixed size, so only resizes that fit succeed */
+static void* poolRealloc(Allocator allocator, void* allocation,
+                         size_t old_size, size_t new_size) {
+  struct Pool* p = poolHeader(allocator);
+  assert(p);
+
+  if (!allocation) return poolSuballoc(allocator, new_size);
+  if (new_size > p->block_size) {
+    fprintf(stderr, "ERR poolRealloc: tried resizing to %zu blocks are %zu!\n",
+            new_size, p->block_size);
+    abort();
+  }
+  if (new_size > old_size)
+    memset((char*)allocation + old_size, 0, new_size - old_size);
+  return allocation;
+}
+
+Allocator poolCreate(size_t block_size, size_t block_count, Allocator host) {
+  assert(block_count && block_count < POOL_NIL);
+
+  block_size = alignUp(block_size ? block_size : 1, ARCH_ALIGNMENT);
+  size_t next_offset = alignUp(sizeof(struct Pool), ARCH_ALIGNMENT);
+  size_t blocks_offset = alignUp(
+      next_offset + block_count * sizeof(_Atomic uint32_t), ARCH_ALIGNMENT);
+  if (block_count > (SIZE_MAX - blocks_offset) / block_size) {
+    fprintf(stderr, "poolCreate: integer overflow\n");
+    abort();
+  }
+  size_t total_size = blocks_offset + block_count * block_size;
+
+  struct Pool* pool = NULL;
+  if (!host) {
+    pool = malloc(total_size);
+  } else {
+    pool = host->mallocFn(host, total_size);
+  }
+
+  if (!pool) {
+    fprintf(stderr, "not enough RAM to allocate Pool\n");
+    abort();
+  }
+
+  pool->vtable =
+      (struct AllocatorVTable){poolSuballoc, poolFree, poolRealloc};
+  pool->host = host;
+  pool->block_size = block_size;
+  pool->block_count = block_count;
+  pool->next = (_Atomic uint32_t*)((char*)pool + next_offset);
+  pool->blocks = (char*)pool + blocks_offset;
+
+  for (size_t i = 0; i < block_count; i++) {
+    uint32_t next = (i + 1 < block_count) ? i + 1 : POOL_NIL;
+    atomic_init(&pool->next[i], next);
+  }
+  atomic_init(&pool->head, 0);
+
+  return &pool->vtable;
+}
+
+void poolDestroy(Allocator a) {
+  struct Pool* pool = poolHeader(a);
+  if (pool->host) {
+    pool->host->freeFn(pool->host, pool);
+  } else {
+    free(pool);
+  }
+}
+
 /*
  * FatPtr is an array-type stores its size and is backed by an allocator
- * a sentinal value is at the start of the structure to detect memory
+ * a sentinal value is at the start of the structure and in checked
+ * builds a canary follows the last element, these detect memory
  * corruption that could have leaked into this array
  */
-struct FatPtr {
-  uint32_t sentinal;
-  size_t count;
-  char data[];
-};
+#if FAT_PTR_CHECKED
+#define FAT_PTR_CANARY_SIZE sizeof(uint32_t)
+#else
+#define FAT_PTR_CANARY_SIZE 0
+#endif
+
+static void* fatPtrCanary(struct FatPtr* s) {
+  return s->data + s->count * s->stride;
+}
+
+static inline void fatPtrCanaryPut(struct FatPtr* s) {
+#if FAT_PTR_CHECKED
+  uint32_t canary = UINT32_DEADBEEF;
+  memcpy(fatPtrCanary(s), &canary, sizeof(canary));
+#else
+  (void)s;
+#endif
+}
+
+static inline size_t fatPtrAllocSize(size_t capacity, size_t stride) {
+  return sizeof(struct FatPtr) + capacity * stride + FAT_PTR_CANARY_SIZE;
+}
 
 /*
- * by using container_of() we can keep the calling scopes typing of
- * the array by hiding info behind the data pointer, this tecnique
- * also maintains alignment of data[] assuming its container is aligned.
- * A sentinal is checked for integrity, this indicates if the array
- * was corrupted or this function was used on a non-slice pointer.
- */
-static inline struct FatPtr* fatPtrHeader(void* data_ptr) {
-  struct FatPtr* s = container_of(data_ptr, struct FatPtr, data);
+ * the sentinal indicates if the array was corrupted from below or this
+ * function was used on a non-slice pointer, the canary indicates a
+ * write that ran off the end of the array
+ */
+void fatPtrVerify(struct FatPtr* s) {
   if (s->sentinal != UINT32_DEADBEEF) {
     printf("error, using unintialised memory, segfault, fatPtrHeader\n");
     abort();
   }
-  return s;
+
+  uint32_t canary;
+  memcpy(&canary, fatPtrCanary(s), sizeof(canary));
+  if (canary != UINT32_DEADBEEF) {
+    printf("error, write past end of %zu element array, fatPtrHeader\n",
+           s->count);
+    abort();
+  }
+}
+
+size_t fatPtrCheckIndex(void* data_ptr, size_t i) {
+  size_t c = fatPtrC(data_ptr);
+  if (i >= c) {
+    printf("error, index %zu out of bounds of %zu, FAT_PTR_AT\n", i, c);
+    abort();
+  }
+  return i;
 }
-size_t fatPtrC(void* data_ptr) { return fatPtrHeader(data_ptr)->count; }
 
 void* fatPtrCreate(size_t c, size_t stride, Allocator allocator) {
 
   assert(allocator);
 
-  if (stride && c > SIZE_MAX / stride) {
+  if (stride && c > (SIZE_MAX - FAT_PTR_CANARY_SIZE) / stride) {
     fprintf(stderr, "count %zu stride %zu\n", c, stride);
     fprintf(stderr, "FatPtrCreate: integer overflow\n");
     return NULL;
   }
-  size_t total_size = sizeof(struct FatPtr) + c * stride;
+  size_t total_size = fatPtrAllocSize(c, stride);
 
   struct FatPtr* s = allocator->mallocFn(allocator, total_size);
   s->sentinal = UINT32_DEADBEEF;
   s->count = c;
+  s->capacity = c;
+  s->stride = stride;
   memset(s->data, 0, c * stride);
+  fatPtrCanaryPut(s);
+  return s->data;
+}
+
+static struct FatPtr* fatPtrRealloc(struct FatPtr* s, size_t capacity,
+                                    Allocator allocator) {
+  assert(allocator && allocator->reallocFn);
+
+  if (s->stride && capacity > (SIZE_MAX - FAT_PTR_CANARY_SIZE) / s->stride) {
+    fprintf(stderr, "FatPtrRealloc: integer overflow\n");
+    abort();
+  }
+
+  s = allocator->reallocFn(allocator, s,
+                           fatPtrAllocSize(s->capacity, s->stride),
+                           fatPtrAllocSize(capacity, s->stride));
+  s->capacity = capacity;
+  return s;
+}
+
+/* ensures room for c elements without moving the array again */
+void* fatPtrReserve(void* data_ptr, size_t c, Allocator allocator) {
+  struct FatPtr* s = fatPtrHeader(data_ptr);
+  if (c <= s->capacity) return data_ptr;
+
+  return fatPtrRealloc(s, c, allocator)->data;
+}
+
+/* appends n zeroed elements, doubling capacity when it runs out */
+void* fatPtrGrow(void* data_ptr, size_t n, Allocator allocator) {
+  struct FatPtr* s = fatPtrHeader(data_ptr);
+  size_t c = s->count + n;
+
+  if (c > s->capacity) {
+    size_t capacity = s->capacity ? s->capacity : 1;
+    while (capacity < c) capacity *= 2;
+    s = fatPtrRealloc(s, capacity, allocator);
+  }
+
+  memset(s->data + s->count * s->stride, 0, n * s->stride);
+  s->count = c;
+  fatPtrCanaryPut(s);
   return s->data;
 }
 
+/* releases unused capacity, in place for allocators that support it */
+void* fatPtrShrink(void* data_ptr, Allocator allocator) {
+  struct FatPtr* s = fatPtrHeader(data_ptr);
+  if (s->count == s->capacity) return data_ptr;
+
+  return fatPtrRealloc(s, s->count, allocator)->data;
+}
+
+/* drops elements past c, capacity is kept */
+void fatPtrTruncate(void* data_ptr, size_t c) {
+  struct FatPtr* s = fatPtrHeader(data_ptr);
+  if (c >= s->count) return;
+
+  s->count = c;
+  fatPtrCanaryPut(s);
+}
+
 void fatPtrDestroy(void* s_ptr, Allocator allocator) {
   struct FatPtr* s = fatPtrHeader(s_ptr);
   allocator->freeFn(allocator, s);
@@ -136,45 +446,113 @@ void fatPtrDestroy(void* s_ptr, Allocator allocator) {
 
 /*
  * Bitmaps
- * a 1-bit image datatype
+ * a 1-bit image datatype, pixels are packed LSB first into 64-bit
+ * words. Rows are addressed by a stride in bits: rows at least a word
+ * wide start on a word boundary, narrower rows are padded to the next
+ * power of two and share words without ever straddling one, so a
+ * 16x16 chunk mask is exactly four words. Padding bits past the width
+ * of a row are always kept zero, this lets the bulk operations run
+ * over the raw word array without masking.
  */
 struct Bitmap {
   uint32_t width;
   uint32_t height;
-  char data[];
+  uint32_t row_bits;  // stride between rows, in bits
+  uint32_t word_count;
+  uint64_t data[];
 };
 
-#define BITMASK_AT(offset) (1 << (7 - (offset)))
+static inline uint64_t lowMask(int64_t n) {
+  if (n <= 0) return 0;
+  return n >= BITMAP_WORD_BITS ? ~0ULL : (1ULL << n) - 1;
+}
+
+static inline uint32_t bitmapRowBits(uint32_t width) {
+  if (width >= BITMAP_WORD_BITS) return alignUp(width, BITMAP_WORD_BITS);
+
+  uint32_t row_bits = 1;
+  while (row_bits < width) row_bits <<= 1;
+  return row_bits;
+}
+
+static inline size_t bitmapWordCount(uint32_t width, uint32_t height) {
+  size_t bits = (size_t)bitmapRowBits(width) * height;
+  return (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/* reads the 64 bits that start at bit index 'bit' of the word array,
+ * straddling two words when unaligned
+ */
+static inline uint64_t bitsRead(struct Bitmap* bmp, size_t bit) {
+  size_t w = bit / BITMAP_WORD_BITS;
+  uint32_t o = bit % BITMAP_WORD_BITS;
+  uint64_t v = bmp->data[w] >> o;
+  if (o && w + 1 < bmp->word_count)
+    v |= bmp->data[w + 1] << (BITMAP_WORD_BITS - o);
+  return v;
+}
 
-static inline uint32_t roundBitUp(uint32_t bit_index) {
-  // add 7, clear last three bits, rounding down
-  return (bit_index + 7) & ~7;
+static inline void bitsWrite(struct Bitmap* bmp, size_t bit, uint64_t val,
+                             uint64_t mask) {
+  size_t w = bit / BITMAP_WORD_BITS;
+  uint32_t o = bit % BITMAP_WORD_BITS;
+  val &= mask;
+  bmp->data[w] = (bmp->data[w] & ~(mask << o)) | (val << o);
+  if (o && w + 1 < bmp->word_count) {
+    uint32_t r = BITMAP_WORD_BITS - o;
+    bmp->data[w + 1] = (bmp->data[w + 1] & ~(mask >> r)) | (val >> r);
+  }
 }
 
-static inline uint8_t getBitInByte(uint8_t offset, uint8_t byte) {
-  return byte & BITMASK_AT(offset) ? 1 : 0;
+/* returns the 64 pixels of row y that start at column x,
+ * columns outside of the row read as 0
+ */
+static uint64_t rowRead(struct Bitmap* bmp, uint32_t y, int64_t x) {
+  if (x >= bmp->width || x <= -BITMAP_WORD_BITS) return 0;
+  size_t row = (size_t)y * bmp->row_bits;
+  if (x < 0) return (bitsRead(bmp, row) & lowMask(bmp->width)) << -x;
+  return bitsRead(bmp, row + x) & lowMask(bmp->width - x);
+}
+
+/* writes the bits of val selected by mask to the 64 pixels of row y
+ * that start at column x, columns outside of the row are dropped
+ */
+static void rowWrite(struct Bitmap* bmp, uint32_t y, int64_t x, uint64_t val,
+                     uint64_t mask) {
+  if (x >= bmp->width || x <= -BITMAP_WORD_BITS) return;
+  if (x < 0) {
+    val >>= -x;
+    mask >>= -x;
+    x = 0;
+  }
+  mask &= lowMask(bmp->width - x);
+  bitsWrite(bmp, (size_t)y * bmp->row_bits + x, val, mask);
 }
 
 static inline size_t bitmapDataSize(uint32_t width, uint32_t height) {
-  return (roundBitUp(width) * roundBitUp(height)) / 8;
+  return bitmapWordCount(width, height) * sizeof(uint64_t);
 }
 
 void bitmapFill(struct Bitmap* bmp, uint8_t val) {
   if (!bmp) return;
-  if (val) val = 1;
 
-  size_t size = bitmapDataSize(bmp->width, bmp->height);
-  memset(bmp->data, val, size);
+  memset(bmp->data, 0, bitmapDataSize(bmp->width, bmp->height));
+  if (!val) return;
+
+  for (uint32_t y = 0; y < bmp->height; y++)
+    for (uint32_t x = 0; x < bmp->width; x += BITMAP_WORD_BITS)
+      rowWrite(bmp, y, x, ~0ULL, ~0ULL);
 }
 
 struct Bitmap* bitmapCreate(uint32_t width, uint32_t height,
                             Allocator allocator) {
   size_t total_size = sizeof(Bitmap) + bitmapDataSize(width, height);
-  ;
 
   Bitmap* bmp = allocator->mallocFn(allocator, total_size);
   bmp->width = width;
   bmp->height = height;
+  bmp->row_bits = bitmapRowBits(width);
+  bmp->word_count = bitmapWordCount(width, height);
   bitmapFill(bmp, 0);
   return bmp;
 }
@@ -183,29 +561,159 @@ void bitmapDestroy(Bitmap* bmp, Allocator allocator) {
   allocator->freeFn(allocator, bmp);
 }
 
+uint32_t bitmapWidth(Bitmap* bmp) { return bmp->width; }
+
+uint32_t bitmapHeight(Bitmap* bmp) { return bmp->height; }
+
+uint32_t bitmapStride(Bitmap* bmp) { return bmp->row_bits; }
+
+/* word holding the first pixel of row y, narrow rows begin at bit
+ * (y * stride) % 64 of it
+ */
+uint64_t* bitmapRow(Bitmap* bmp, int32_t y) {
+  assert(y >= 0 && y < (int)bmp->height);
+  return &bmp->data[((size_t)y * bmp->row_bits) / BITMAP_WORD_BITS];
+}
+
+/* the 64 pixels of row y starting at column x, aligned to bit 0,
+ * pixels outside of the bitmap read as 0
+ */
+uint64_t bitmapRowWord(Bitmap* bmp, int32_t y, int32_t x) {
+  if (y < 0 || y >= (int)bmp->height) return 0;
+  return rowRead(bmp, y, x);
+}
+
 int bitmapGetPx(struct Bitmap* bmp, int32_t x, int32_t y) {
   if (!bmp || x < 0 || x >= (int)bmp->width || y < 0 || y >= (int)bmp->height)
     return 1;
 
-  int bit_index = y * bmp->width + x;
-  int offset = bit_index % 8;
-  uint8_t byte = bmp->data[bit_index / 8];
-  return getBitInByte(offset, byte);
+  size_t bit = (size_t)y * bmp->row_bits + x;
+  return (bmp->data[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
 }
 
 int bitmapPutPx(struct Bitmap* bmp, int32_t x, int32_t y, int val) {
   if (!bmp || x < 0 || x >= (int)bmp->width || y < 0 || y >= (int)bmp->height)
     return 1;
 
-  int bit_index = y * bmp->width + x;
-  int offset = bit_index % 8;
-  char* dst = &bmp->data[bit_index / 8];
+  size_t bit = (size_t)y * bmp->row_bits + x;
+  uint64_t* dst = &bmp->data[bit / BITMAP_WORD_BITS];
+  uint64_t mask = 1ULL << (bit % BITMAP_WORD_BITS);
 
   if (val)
-    *dst |= BITMASK_AT(offset);
+    *dst |= mask;
   else
-    *dst &= ~BITMASK_AT(offset);
+    *dst &= ~mask;
 
   return 0;
 }
 
+/*
+ * Bulk operations
+ * the boolean ops walk the word arrays of two equally sized bitmaps
+ * in a single branch-free loop so the compiler can vectorise them
+ */
+#define ASSERT_BITMAP_DIMS(a_, b_) \
+  (assert((a_)->width == (b_)->width && (a_)->height == (b_)->height))
+
+void bitmapAnd(Bitmap* dst, Bitmap* src) {
+  ASSERT_BITMAP_DIMS(dst, src);
+  uint64_t* restrict d = dst->data;
+  const uint64_t* restrict s = src->data;
+  for (size_t i = 0; i < dst->word_count; i++) d[i] &= s[i];
+}
+
+void bitmapOr(Bitmap* dst, Bitmap* src) {
+  ASSERT_BITMAP_DIMS(dst, src);
+  uint64_t* restrict d = dst->data;
+  const uint64_t* restrict s = src->data;
+  for (size_t i = 0; i < dst->word_count; i++) d[i] |= s[i];
+}
+
+void bitmapAndNot(Bitmap* dst, Bitmap* src) {
+  ASSERT_BITMAP_DIMS(dst, src);
+  uint64_t* restrict d = dst->data;
+  const uint64_t* restrict s = src->data;
+  for (size_t i = 0; i < dst->word_count; i++) d[i] &= ~s[i];
+}
+
+size_t bitmapCount(Bitmap* bmp) {
+  size_t count = 0;
+  for (size_t i = 0; i < bmp->word_count; i++)
+    count += __builtin_popcountll(bmp->data[i]);
+  return count;
+}
+
+/* finds the first set pixel in row-major order,
+ * returns 0 if the bitmap is empty
+ */
+int bitmapFindFirst(Bitmap* bmp, int32_t* x_out, int32_t* y_out) {
+  for (size_t i = 0; i < bmp->word_count; i++) {
+    if (!bmp->data[i]) continue;
+    size_t bit = i * BITMAP_WORD_BITS + __builtin_ctzll(bmp->data[i]);
+    *x_out = bit % bmp->row_bits;
+    *y_out = bit / bmp->row_bits;
+    return 1;
+  }
+  return 0;
+}
+
+/* copies the w * h rectangle at (sx, sy) of src to (dx, dy) of dst,
+ * pixels falling outside of either bitmap are clipped.
+ * src and dst must not be the same bitmap, see bitmapShift()
+ */
+void bitmapCopyRect(Bitmap* dst, int32_t dx, int32_t dy, Bitmap* src,
+                    int32_t sx, int32_t sy, uint32_t w, uint32_t h) {
+  assert(dst != src);
+  for (uint32_t r = 0; r < h; r++) {
+    int64_t src_y = (int64_t)sy + r;
+    int64_t dst_y = (int64_t)dy + r;
+    if (dst_y < 0 || dst_y >= dst->height) continue;
+
+    for (uint32_t k = 0; k < w; k += BITMAP_WORD_BITS) {
+      uint64_t v = 0;
+      if (src_y >= 0 && src_y < src->height)
+        v = rowRead(src, src_y, (int64_t)sx + k);
+      rowWrite(dst, dst_y, (int64_t)dx + k, v, lowMask(w - k));
+    }
+  }
+}
+
+/* as bitmapCopyRect but the rectangle is ORed into dst, writing only
+ * the pixels that are set in src
+ */
+void bitmapOrRect(Bitmap* dst, int32_t dx, int32_t dy, Bitmap* src,
+                  int32_t sx, int32_t sy, uint32_t w, uint32_t h) {
+  assert(dst != src);
+  for (uint32_t r = 0; r < h; r++) {
+    int64_t src_y = (int64_t)sy + r;
+    int64_t dst_y = (int64_t)dy + r;
+    if (dst_y < 0 || dst_y >= dst->height) continue;
+    if (src_y < 0 || src_y >= src->height) continue;
+
+    for (uint32_t k = 0; k < w; k += BITMAP_WORD_BITS) {
+      uint64_t v = rowRead(src, src_y, (int64_t)sx + k);
+      rowWrite(dst, dst_y, (int64_t)dx + k, ~0ULL, v & lowMask(w - k));
+    }
+  }
+}
+
+/* moves every pixel by (dx, dy) in place, vacated pixels are cleared.
+ * Rows and words are visited in the opposite order to the shift so
+ * each read happens before the pixels it reads are overwritten
+ */
+void bitmapShift(Bitmap* bmp, int32_t dx, int32_t dy) {
+  int32_t h = bmp->height;
+  int32_t words = (bmp->width + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+  for (int32_t i = 0; i < h; i++) {
+    int32_t y = (dy > 0) ? h - 1 - i : i;
+    int64_t src_y = (int64_t)y - dy;
+
+    for (int32_t j = 0; j < words; j++) {
+      int64_t x = (int64_t)((dx > 0) ? words - 1 - j : j) * BITMAP_WORD_BITS;
+      uint64_t v = 0;
+      if (src_y >= 0 && src_y < h) v = rowRead(bmp, src_y, x - dx);
+      rowWrite(bmp, y, x, v, ~0ULL);
+    }
+  }
+}
@@ -17,32 +17,140 @@
 typedef struct AllocatorVTable* Allocator;
 typedef void* (*mallocFnPtr)(Allocator, size_t);
 typedef void (*freeFnPtr)(Allocator, void*);
+typedef void* (*reallocFnPtr)(Allocator, void*, size_t, size_t);
 struct AllocatorVTable {
   mallocFnPtr mallocFn;
   freeFnPtr freeFn;
+  reallocFnPtr reallocFn;
 };
 
 Allocator arenaCreate(size_t size, Allocator);
 void arenaDestroy(Allocator);
 
+/*
+ * Thread Local Arenas
+ * one shared vtable, each calling thread lazily gets its own arena
+ * so worker threads never contend on the main thread's arenas
+ */
+#define THREAD_ARENA_RAM_SIZE (1 * MB)
+Allocator threadArenaAllocator(void);
+void threadArenaRelease(void);
+
+/*
+ * Pool Allocator
+ * fixed size blocks on a lock-free free list, any thread may
+ * allocate or free, including blocks allocated by another thread
+ */
+Allocator poolCreate(size_t block_size, size_t block_count, Allocator);
+void poolDestroy(Allocator);
+
 /*
  * Fat Pointers
  * arrays that contain metadata of their bounds
+ *
+ * FAT_PTR_CHECKED builds verify the header sentinal and a canary past
+ * the last element on every header access and bounds check every
+ * FAT_PTR_AT() index. It defaults to on unless NDEBUG is defined,
+ * release builds read the header with no branches at all.
  */
+#ifndef FAT_PTR_CHECKED
+#ifdef NDEBUG
+#define FAT_PTR_CHECKED 0
+#else
+#define FAT_PTR_CHECKED 1
+#endif
+#endif
+
+#define UINT32_DEADBEEF 0xDEADBEEF
+
+struct FatPtr {
+  uint32_t sentinal;
+  size_t count;
+  size_t capacity;
+  size_t stride;
+  _Alignas(max_align_t) char data[];
+};
+
+void fatPtrVerify(struct FatPtr*);
+size_t fatPtrCheckIndex(void*, size_t);
+
+/*
+ * by using container_of() we can keep the calling scopes typing of
+ * the array by hiding info behind the data pointer, this tecnique
+ * also maintains alignment of data[] assuming its container is aligned.
+ */
+static inline struct FatPtr* fatPtrHeader(void* data_ptr) {
+  struct FatPtr* s = container_of(data_ptr, struct FatPtr, data);
+#if FAT_PTR_CHECKED
+  fatPtrVerify(s);
+#endif
+  return s;
+}
+
+static inline size_t fatPtrC(void* data_ptr) {
+  return fatPtrHeader(data_ptr)->count;
+}
+
+static inline size_t fatPtrCap(void* data_ptr) {
+  return fatPtrHeader(data_ptr)->capacity;
+}
+
 void* fatPtrCreate(size_t, size_t, Allocator);
-size_t fatPtrC(void*);
 void fatPtrDestroy(void*, Allocator);
 #define fatPtrSize(data_ptr_) (fatPtrC(data_ptr_) * sizeof(data_ptr_[0]))
 
+/*
+ * Dynamic arrays
+ * these may move the array and return its new location,
+ * capacity grows geometrically so appending is amortised O(1)
+ */
+void* fatPtrReserve(void*, size_t, Allocator);
+void* fatPtrGrow(void*, size_t, Allocator);
+void* fatPtrShrink(void*, Allocator);
+void fatPtrTruncate(void*, size_t);
+
+#define fatPtrPush(data_ptr_, val_, allocator_)                \
+  do {                                                         \
+    (data_ptr_) = fatPtrGrow((data_ptr_), 1, (allocator_));    \
+    (data_ptr_)[fatPtrC(data_ptr_) - 1] = (val_);              \
+  } while (0)
+
+#if FAT_PTR_CHECKED
+#define FAT_PTR_AT(data_ptr_, i_) \
+  ((data_ptr_)[fatPtrCheckIndex((data_ptr_), (i_))])
+#else
+#define FAT_PTR_AT(data_ptr_, i_) ((data_ptr_)[(i_)])
+#endif
+
 /*
  * BitMap
  * 2D 1-bit image representation
  */
+#define BITMAP_WORD_BITS 64
 typedef struct Bitmap Bitmap;
 Bitmap* bitmapCreate(uint32_t, uint32_t, Allocator);
 void bitmapDestroy(Bitmap*, Allocator);
 void bitmapFill(Bitmap*, uint8_t);
 int bitmapGetPx(Bitmap*, int32_t, int32_t);
 int bitmapPutPx(Bitmap*, int32_t, int32_t, int);
+uint32_t bitmapWidth(Bitmap*);
+uint32_t bitmapHeight(Bitmap*);
+
+/* row access, stride is the distance between rows in bits */
+uint32_t bitmapStride(Bitmap*);
+uint64_t* bitmapRow(Bitmap*, int32_t);
+uint64_t bitmapRowWord(Bitmap*, int32_t, int32_t);
+
+/* bulk operations, dst and src must share dimensions */
+void bitmapAnd(Bitmap* dst, Bitmap* src);
+void bitmapOr(Bitmap* dst, Bitmap* src);
+void bitmapAndNot(Bitmap* dst, Bitmap* src);
+size_t bitmapCount(Bitmap*);
+int bitmapFindFirst(Bitmap*, int32_t*, int32_t*);
+void bitmapCopyRect(Bitmap* dst, int32_t, int32_t, Bitmap* src, int32_t,
+                    int32_t, uint32_t, uint32_t);
+void bitmapOrRect(Bitmap* dst, int32_t, int32_t, Bitmap* src, int32_t,
+                  int32_t, uint32_t, uint32_t);
+void bitmapShift(Bitmap*, int32_t, int32_t);
 
 #endif  // ALLOCATOR_H
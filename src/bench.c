@@ -0,0 +1,307 @@
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dungeon.h"
+#include "fov.h"
+
+static uint64_t benchNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* an open field of scattered pillars with portal_count one way portals
+ * whose destinations are also open, portal tiles are never walls
+ */
+static void benchFovMap(struct Map* m, int portal_count) {
+  struct Terra wall = {.tile = (struct UnicodeTile){363, 2, 8, 0},
+                       .blocks_view = 1,
+                       .blocks_move = 1};
+
+  for (int i = 0; i < portal_count; i++) {
+    portalCreate(m, rand() % BENCH_MAP_LEN, rand() % BENCH_MAP_LEN,
+                 rand() % BENCH_MAP_LEN, rand() % BENCH_MAP_LEN);
+  }
+
+  for (uint32_t y = 0; y < BENCH_MAP_LEN; y++) {
+    for (uint32_t x = 0; x < BENCH_MAP_LEN; x++) {
+      if (rand() % 8 || spatialHashGet(m->portals.hash, x, y)) continue;
+      terraPut(m, x, y, wall);
+    }
+  }
+}
+
+/* caves from a len * len random fill smoothed by BENCH_CAVE_PASSES of
+ * the 4-5 cellular automaton rule, a tile becomes wall when at least 5
+ * of the 9 tiles around it are, tiles past the edge count as wall,
+ * the scratch bitmaps come from allocator so it must not be the map's
+ */
+static void benchCaveMap(struct Map* m, uint32_t len, Allocator allocator) {
+  struct Terra wall = {.tile = (struct UnicodeTile){363, 2, 8, 0},
+                       .blocks_view = 1,
+                       .blocks_move = 1};
+  Bitmap* cave = bitmapCreate(len, len, allocator);
+  Bitmap* next = bitmapCreate(len, len, allocator);
+
+  for (uint32_t y = 0; y < len; y++)
+    for (uint32_t x = 0; x < len; x++)
+      bitmapPutPx(cave, x, y, rand() % 100 < BENCH_CAVE_FILL);
+
+  for (int pass = 0; pass < BENCH_CAVE_PASSES; pass++) {
+    for (int32_t y = 0; y < (int32_t)len; y++) {
+      for (int32_t x = 0; x < (int32_t)len; x++) {
+        int walls = 0;
+        for (int32_t dy = -1; dy <= 1; dy++) {
+          for (int32_t dx = -1; dx <= 1; dx++) {
+            int32_t nx = x + dx, ny = y + dy;
+            walls += nx < 0 || ny < 0 || nx >= (int32_t)len ||
+                     ny >= (int32_t)len || bitmapGetPx(cave, nx, ny);
+          }
+        }
+        bitmapPutPx(next, x, y, walls >= 5);
+      }
+    }
+    Bitmap* swap = cave;
+    cave = next;
+    next = swap;
+  }
+
+  for (uint32_t y = 0; y < len; y++)
+    for (uint32_t x = 0; x < len; x++)
+      if (bitmapGetPx(cave, x, y)) terraPut(m, x, y, wall);
+
+  bitmapDestroy(next, allocator);
+  bitmapDestroy(cave, allocator);
+}
+
+static const char* BENCH_FOV_NAMES[FOV_ALGORITHM_COUNT] = {
+    "shadowcast", "raycast", "raycast scalar", "raycast sse2",
+    "raycast avx2"};
+
+/* times every supported algorithm from the same walk of open viewer
+ * positions inside a len * len map, agreement is the share of mask
+ * pixels that match shadowcasting
+ */
+static void benchFovAlgorithms(const char* name, struct Map* m, uint32_t len,
+                               Allocator allocator) {
+  Bitmap* mask = fovMaskCreate(FOV_RADIUS_DEFAULT, allocator);
+  Bitmap* ref = fovMaskCreate(FOV_RADIUS_DEFAULT, allocator);
+  size_t mask_px = bitmapWidth(mask) * bitmapHeight(mask);
+
+  for (int a = 0; a < FOV_ALGORITHM_COUNT; a++) {
+    if (!fovAlgorithmSupported(a)) continue;
+    size_t differ = 0;
+    uint64_t elapsed = 0;
+    srand(3);
+    for (int i = 0; i < BENCH_FOV_FRAMES; i++) {
+      uint32_t x, y;
+      do {
+        x = rand() % len;
+        y = rand() % len;
+      } while (terraGet(m, x, y).blocks_view);
+
+      uint64_t start = benchNow();
+      fovComputeWith(a, m, x, y, FOV_RADIUS_DEFAULT, mask);
+      elapsed += benchNow() - start;
+
+      fovCompute(m, x, y, FOV_RADIUS_DEFAULT, ref);
+      size_t seen = bitmapCount(mask) + bitmapCount(ref);
+      bitmapAnd(ref, mask);
+      differ += seen - 2 * bitmapCount(ref);
+    }
+
+    printf("fov %s %s: %.2f us/frame %.1f%% agreement\n", name,
+           BENCH_FOV_NAMES[a], elapsed / 1000.0 / BENCH_FOV_FRAMES,
+           100.0 - 100.0 * differ / ((double)mask_px * BENCH_FOV_FRAMES));
+  }
+
+  bitmapDestroy(ref, allocator);
+  bitmapDestroy(mask, allocator);
+}
+
+/* times a tick of BENCH_BATCH_VIEWERS casts one at a time and then
+ * batched, viewers are scattered over a spread * spread square so a
+ * wide spread puts them on far apart chunks, agreement is the share of
+ * batched masks identical to fovCompute
+ */
+static void benchFovBatch(const char* name, struct Map* m, uint32_t spread,
+                          Allocator allocator) {
+  struct FovViewer* viewers =
+      allocator->mallocFn(allocator, sizeof(*viewers) * BENCH_BATCH_VIEWERS);
+  Bitmap** masks =
+      allocator->mallocFn(allocator, sizeof(*masks) * BENCH_BATCH_VIEWERS);
+  Bitmap* ref = fovMaskCreate(FOV_RADIUS_DEFAULT, allocator);
+
+  srand(4);
+  for (int i = 0; i < BENCH_BATCH_VIEWERS; i++) {
+    viewers[i] = (struct FovViewer){rand() % spread, rand() % spread};
+    masks[i] = fovMaskCreate(FOV_RADIUS_DEFAULT, allocator);
+  }
+
+  uint64_t start = benchNow();
+  for (int i = 0; i < BENCH_BATCH_VIEWERS; i++) {
+    fovCompute(m, viewers[i].x, viewers[i].y, FOV_RADIUS_DEFAULT, masks[i]);
+  }
+  uint64_t single = benchNow() - start;
+
+  start = benchNow();
+  fovComputeBatch(m, viewers, BENCH_BATCH_VIEWERS, FOV_RADIUS_DEFAULT, masks,
+                  BENCH_BATCH_THREADS, allocator);
+  uint64_t batched = benchNow() - start;
+
+  int same = 0;
+  for (int i = 0; i < BENCH_BATCH_VIEWERS; i++) {
+    fovCompute(m, viewers[i].x, viewers[i].y, FOV_RADIUS_DEFAULT, ref);
+    size_t seen = bitmapCount(masks[i]) + bitmapCount(ref);
+    bitmapAnd(ref, masks[i]);
+    same += seen == 2 * bitmapCount(ref);
+  }
+
+  printf("fov batch %s: %.2f us/tick single %.2f us/tick batched "
+         "(%d threads) %d/%d masks agree\n",
+         name, single / 1000.0, batched / 1000.0, BENCH_BATCH_THREADS, same,
+         BENCH_BATCH_VIEWERS);
+
+  for (int i = BENCH_BATCH_VIEWERS - 1; i >= 0; i--)
+    bitmapDestroy(masks[i], allocator);
+  bitmapDestroy(ref, allocator);
+  allocator->freeFn(allocator, masks);
+  allocator->freeFn(allocator, viewers);
+}
+
+/* times the main cast on its own and then with portal views at each
+ * depth budget, from the same walk of viewer positions every time
+ */
+void benchFov(void) {
+  Allocator arena = arenaCreate(BENCH_ALLOCATOR_RAM_SIZE, NULL);
+  Allocator view_arena = arenaCreate(FOV_PORTAL_RAM_SIZE, NULL);
+  struct Map map = mapCreate(arena);
+
+  srand(1);
+  benchFovMap(&map, BENCH_MAP_LEN / 2);
+  Bitmap* mask = fovMaskCreate(FOV_RADIUS_DEFAULT, arena);
+
+  for (uint32_t depth = 0; depth <= FOV_PORTAL_DEPTH_DEFAULT + 2; depth++) {
+    size_t view_count = 0;
+    srand(2);
+    uint64_t start = benchNow();
+    for (int i = 0; i < BENCH_FOV_FRAMES; i++) {
+      uint32_t x = rand() % BENCH_MAP_LEN;
+      uint32_t y = rand() % BENCH_MAP_LEN;
+      fovCompute(&map, x, y, FOV_RADIUS_DEFAULT, mask);
+      struct FovPortalView* views = fovComputePortals(
+          &map, x, y, FOV_RADIUS_DEFAULT, mask, depth, view_arena);
+      view_count += fatPtrC(views);
+      fovPortalViewsDestroy(views, view_arena);
+    }
+    uint64_t elapsed = benchNow() - start;
+
+    printf("fov radius %d portal depth %u: %.2f us/frame %.2f views/frame\n",
+           FOV_RADIUS_DEFAULT, depth,
+           elapsed / 1000.0 / BENCH_FOV_FRAMES,
+           (double)view_count / BENCH_FOV_FRAMES);
+  }
+
+  benchFovAlgorithms("pillar field", &map, BENCH_MAP_LEN, arena);
+  benchFovBatch("clustered", &map, BENCH_MAP_LEN, arena);
+  benchFovBatch("scattered", &map, UINT32_MAX, arena);
+
+  struct Map caves = mapCreate(arena);
+  srand(5);
+  benchCaveMap(&caves, BENCH_MAP_LEN, view_arena);
+  benchFovAlgorithms("caves", &caves, BENCH_MAP_LEN, arena);
+
+  struct Map maze = mapCreate(arena);
+  dungeonBuild(&maze);
+  benchFovAlgorithms("wfc maze", &maze, BENCH_MAZE_LEN, arena);
+
+  bitmapDestroy(mask, arena);
+  arenaDestroy(view_arena);
+  arenaDestroy(arena);
+}
+
+/* the shadowcast as it was before slopes were kept in integers, every
+ * slope is resolved to a double and rounded with floor and ceil
+ */
+static void benchFovReferenceRow(struct Map* m, uint32_t x, uint32_t y,
+                                 int cardinal, int depth, double start,
+                                 double end, uint32_t radius, Bitmap* mask) {
+  if (depth > (int)radius || end <= start) return;
+
+  int min_col = floor(depth * start + 0.5);
+  int max_col = ceil(depth * end - 0.5);
+  bool prev_was_wall = false;
+  for (int col = min_col; col <= max_col; col++) {
+    int dx = cardinal == 1 ? depth : cardinal == 3 ? -depth : col;
+    int dy = cardinal == 0 ? -depth : cardinal == 2 ? depth : col;
+    bool is_wall = terraGet(m, x + dx, y + dy).blocks_view;
+    if (is_wall || (col >= depth * start && col <= depth * end))
+      bitmapPutPx(mask, radius + dx, radius + dy, 1);
+
+    double col_slope = (2.0 * col - 1) / (2.0 * depth);
+    if (prev_was_wall && !is_wall) start = col_slope;
+    if (!prev_was_wall && is_wall)
+      benchFovReferenceRow(m, x, y, cardinal, depth + 1, start, col_slope,
+                           radius, mask);
+    prev_was_wall = is_wall;
+  }
+  if (!prev_was_wall)
+    benchFovReferenceRow(m, x, y, cardinal, depth + 1, start, end, radius,
+                         mask);
+}
+
+/* compares fovCompute with the floating point reference from open
+ * viewers on maps of 0 to 60% walls, returns the masks that differ
+ */
+int benchFovTest(void) {
+  struct Terra wall = {.tile = (struct UnicodeTile){363, 2, 8, 0},
+                       .blocks_view = 1,
+                       .blocks_move = 1};
+  int failures = 0;
+  int checked = 0;
+
+  for (int i = 0; i < BENCH_TEST_MAPS; i++) {
+    Allocator arena = arenaCreate(BENCH_ALLOCATOR_RAM_SIZE, NULL);
+    struct Map map = mapCreate(arena);
+    Bitmap* mask = fovMaskCreate(FOV_RADIUS_DEFAULT, arena);
+    Bitmap* ref = fovMaskCreate(FOV_RADIUS_DEFAULT, arena);
+
+    srand(i + 1);
+    int density = i % 61;
+    for (uint32_t y = 0; y < BENCH_TEST_MAP_LEN; y++) {
+      for (uint32_t x = 0; x < BENCH_TEST_MAP_LEN; x++) {
+        if (rand() % 100 < density) terraPut(&map, x, y, wall);
+      }
+    }
+
+    for (int v = 0; v < BENCH_TEST_VIEWERS; v++) {
+      uint32_t x = rand() % BENCH_TEST_MAP_LEN;
+      uint32_t y = rand() % BENCH_TEST_MAP_LEN;
+      if (terraGet(&map, x, y).blocks_view) continue;
+
+      fovCompute(&map, x, y, FOV_RADIUS_DEFAULT, mask);
+      bitmapFill(ref, 0);
+      bitmapPutPx(ref, FOV_RADIUS_DEFAULT, FOV_RADIUS_DEFAULT, 1);
+      for (int cardinal = 0; cardinal < 4; cardinal++) {
+        benchFovReferenceRow(&map, x, y, cardinal, 1, -1.0, 1.0,
+                             FOV_RADIUS_DEFAULT, ref);
+      }
+
+      size_t seen = bitmapCount(mask) + bitmapCount(ref);
+      bitmapAnd(ref, mask);
+      if (seen != 2 * bitmapCount(ref)) {
+        printf("fov test: map %d viewer (%u, %u) differs\n", i, x, y);
+        failures++;
+      }
+      checked++;
+    }
+    arenaDestroy(arena);
+  }
+
+  printf("fov test: %d of %d masks differ\n", failures, checked);
+  return failures;
+}
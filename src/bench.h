@@ -0,0 +1,31 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "map.h"
+
+#define BENCH_ALLOCATOR_RAM_SIZE (4 * MB)
+#define BENCH_MAP_LEN 128
+#define BENCH_MAZE_LEN 32
+#define BENCH_CAVE_FILL 45
+#define BENCH_CAVE_PASSES 4
+#define BENCH_FOV_FRAMES 2000
+#define BENCH_BATCH_VIEWERS 256
+#define BENCH_BATCH_THREADS 4
+#define BENCH_TEST_MAPS 200
+#define BENCH_TEST_MAP_LEN 64
+#define BENCH_TEST_VIEWERS 64
+
+/*
+ * Benchmarks
+ * run from the command line with --bench-fov, each prints the mean
+ * time per frame over a fixed seed so runs can be compared, FOV
+ * algorithms are compared on a pillar field, on cellular automaton
+ * caves and on a WFC maze
+ *
+ * --test-fov checks fovCompute against a floating point shadowcast
+ * on seeded random maps and returns the number of masks that differ
+ */
+void benchFov(void);
+int benchFovTest(void);
+
+#endif  // BENCH_H
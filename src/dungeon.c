@@ -1,36 +1,169 @@
 #include "dungeon.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "wfc.h"
 
+static const struct Terra dungeon_wall = {
+    .tile =
+        {
+            363,
+            2,
+            8,
+            0,
+        },
+    .blocks_view = 1,
+    .blocks_move = 1,
+};
+
+/* a grey pixel with the sample's components, opaque if it has alpha */
+static void dungeonPixel(unsigned char* px, int component_count,
+                         unsigned char grey) {
+  for (int c = 0; c < component_count; c++) px[c] = grey;
+  if (component_count == 2 || component_count == 4)
+    px[component_count - 1] = 255;
+}
+
+/* one attempt per core, up to DUNGEON_WFC_MAX_THREADS */
+static int dungeonThreadCount(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) return 1;
+  return cores < DUNGEON_WFC_MAX_THREADS ? cores : DUNGEON_WFC_MAX_THREADS;
+}
+
 void dungeonBuild(struct Map* m) {
   struct wfc_image* sample = wfc_img_load("textures/wfctest.png");
-  struct wfc* wfc = wfc_overlapping(32, 32, sample, 3, 3, 1, 1, 1, 1);
-  wfc_run(wfc, -1);
+  struct wfc* wfc = wfc_overlapping_cached(
+      32, 32, sample, DUNGEON_WFC_TILE_LEN, DUNGEON_WFC_TILE_LEN, 1, 1, 1, 1,
+      DUNGEON_WFC_CACHE);
+  wfc_set_backtracking(wfc, DUNGEON_WFC_BACKTRACK_DEPTH,
+                       DUNGEON_WFC_MAX_RESTARTS);
 
-  struct wfc_image* output = wfc_output_image(wfc);
+  if (!wfc_run_parallel(wfc, -1, dungeonThreadCount())) {
+    struct wfc_stats stats = wfc_get_stats(wfc);
+    fprintf(stderr,
+            "dungeonBuild: no solution after %d backtracks and %d restarts\n",
+            stats.backtracks, stats.restarts);
+    wfc_img_destroy(sample);
+    wfc_destroy(wfc);
+    return;
+  }
 
-  struct Terra terra = {
-      .tile =
-          (struct UnicodeTile){
-              363,
-              2,
-              8,
-              0,
-          },
-      .blocks_view = 1,
-      .blocks_move = 1,
-  };
+  struct wfc_image* output = wfc_output_image(wfc);
 
   for (int y = 0; y < output->height; y++) {
     for (int x = 0; x < output->width; x++) {
       size_t i = (y * output->width + x) * output->component_cnt;
       if (output->data[i] == 0) {
-        terraPut(m, x, y, terra);
+        terraPut(m, x, y, dungeon_wall);
       }
     }
   }
 
   //wfc_export(wfc, "output_test.png");
+  wfc_img_destroy(output);
   wfc_img_destroy(sample);
   wfc_destroy(wfc);
 }
+
+struct DungeonGen* dungeonGenCreate(uint32_t seed, Allocator a) {
+  struct DungeonGen* gen = a->mallocFn(a, sizeof(*gen));
+  gen->seed = seed;
+  gen->thread_count = dungeonThreadCount();
+  gen->sample = wfc_img_load("textures/wfctest.png");
+  gen->wfc = wfc_overlapping_cached(
+      DUNGEON_WFC_REGION_LEN, DUNGEON_WFC_REGION_LEN, gen->sample,
+      DUNGEON_WFC_TILE_LEN, DUNGEON_WFC_TILE_LEN, 1, 1, 1, 1,
+      DUNGEON_WFC_CACHE);
+  if (!gen->wfc) {
+    fprintf(stderr, "dungeonGenCreate: couldn't build the wfc model\n");
+    abort();
+  }
+  wfc_set_backtracking(gen->wfc, DUNGEON_WFC_BACKTRACK_DEPTH,
+                       DUNGEON_WFC_MAX_RESTARTS);
+  dungeonPixel(gen->wall_px, gen->sample->component_cnt, 0);
+  dungeonPixel(gen->floor_px, gen->sample->component_cnt, 255);
+  return gen;
+}
+
+void dungeonGenDestroy(struct DungeonGen* gen, Allocator a) {
+  wfc_destroy(gen->wfc);
+  wfc_img_destroy(gen->sample);
+  a->freeFn(a, gen);
+}
+
+/* neighbour sets to pin, tried in order until the pins agree, bit
+ * (dy + 1) * 3 + (dx + 1) is the chunk at (dx, dy). Chunks that never
+ * saw each other can leave a corner no pattern fits, so after all
+ * eight the diagonals are dropped, then one edge at a time, then the
+ * opposite pairs, then each edge alone, and last nothing is pinned
+ */
+static const uint16_t dungeon_pin_sets[] = {
+    0x1FF, 0x0AA, 0x0A2, 0x0A8, 0x08A, 0x02A, 0x028,
+    0x082, 0x008, 0x020, 0x002, 0x080, 0,
+};
+
+/* pins every margin cell that lies in an existing chunk of the set to
+ * that chunk's wall or floor, returns false if the pins contradict
+ */
+static bool dungeonGenConstrain(struct DungeonGen* gen, struct Map* m,
+                                uint32_t x0, uint32_t y0, uint16_t pins) {
+  uint32_t wrap = UINT32_MAX / CHUNK_LEN;
+  int hi = DUNGEON_WFC_MARGIN + CHUNK_LEN;
+  for (int y = 0; y < DUNGEON_WFC_REGION_LEN; y++) {
+    for (int x = 0; x < DUNGEON_WFC_REGION_LEN; x++) {
+      int dx = x < DUNGEON_WFC_MARGIN ? -1 : x >= hi ? 1 : 0;
+      int dy = y < DUNGEON_WFC_MARGIN ? -1 : y >= hi ? 1 : 0;
+      uint32_t wx = x0 + x, wy = y0 + y;
+      if ((!dx && !dy) || !(pins & (1 << ((dy + 1) * 3 + dx + 1))) ||
+          !spatialHashGet(m->chunks.hash, (wx / CHUNK_LEN) & wrap,
+                          (wy / CHUNK_LEN) & wrap))
+        continue;
+
+      const unsigned char* px =
+          terraGet(m, wx, wy).blocks_move ? gen->wall_px : gen->floor_px;
+      if (!wfc_constrain(gen->wfc, x, y, px)) return false;
+    }
+  }
+  return true;
+}
+
+void dungeonGenChunk(struct Map* m, uint32_t chunk_x, uint32_t chunk_y,
+                     void* ctx) {
+  struct DungeonGen* gen = ctx;
+  uint32_t x0 = chunk_x * CHUNK_LEN - DUNGEON_WFC_MARGIN;
+  uint32_t y0 = chunk_y * CHUNK_LEN - DUNGEON_WFC_MARGIN;
+
+  bool solved = false;
+  size_t set_count = sizeof(dungeon_pin_sets) / sizeof(dungeon_pin_sets[0]);
+  for (size_t i = 0; !solved && i < set_count; i++) {
+    // seeded per chunk so the same seed and neighbours give the same
+    // chunk, which neighbours exist depends on the order of exploration
+    wfc_init(gen->wfc);
+    wfc_seed(gen->wfc,
+             gen->seed ^ (chunk_x * 73856093u) ^ (chunk_y * 19349663u));
+    solved = dungeonGenConstrain(gen, m, x0, y0, dungeon_pin_sets[i]) &&
+             wfc_run_parallel(gen->wfc, -1, gen->thread_count);
+  }
+  if (!solved) {
+    fprintf(stderr, "dungeonGenChunk: %u %u has no solution\n", chunk_x,
+            chunk_y);
+    return;
+  }
+
+  struct wfc_image* output = wfc_output_image(gen->wfc);
+  for (int y = 0; y < CHUNK_LEN; y++) {
+    for (int x = 0; x < CHUNK_LEN; x++) {
+      size_t i = ((y + DUNGEON_WFC_MARGIN) * output->width + x +
+                  DUNGEON_WFC_MARGIN) *
+                 output->component_cnt;
+      if (output->data[i] == 0) {
+        terraPut(m, chunk_x * CHUNK_LEN + x, chunk_y * CHUNK_LEN + y,
+                 dungeon_wall);
+      }
+    }
+  }
+  wfc_img_destroy(output);
+}
@@ -1,2 +1,32 @@
 #include "map.h"
+
+#define DUNGEON_WFC_BACKTRACK_DEPTH 64
+#define DUNGEON_WFC_MAX_RESTARTS 8
+#define DUNGEON_WFC_MAX_THREADS 4
+#define DUNGEON_WFC_TILE_LEN 3
+#define DUNGEON_WFC_CACHE "textures/wfctest.wfc"
+#define DUNGEON_WFC_MARGIN (DUNGEON_WFC_TILE_LEN - 1)
+#define DUNGEON_WFC_REGION_LEN (CHUNK_LEN + 2 * DUNGEON_WFC_MARGIN)
+#define DUNGEON_GEN_RADIUS (2 * CHUNK_LEN)
+
+/*
+ * Dungeon Generator
+ * a MapGenFn that grows the dungeon one chunk at a time, each chunk is
+ * a WFC region padded by a margin pinned to the neighbouring chunks
+ * that already exist so the seams match the sample, attempts at a
+ * chunk run on thread_count threads at once
+ */
+struct DungeonGen {
+  struct wfc_image* sample;
+  struct wfc* wfc;
+  uint32_t seed;
+  int thread_count;
+  unsigned char wall_px[4];  // in the sample's components
+  unsigned char floor_px[4];
+};
+
 void dungeonBuild(struct Map*);
+struct DungeonGen* dungeonGenCreate(uint32_t seed, Allocator);
+void dungeonGenDestroy(struct DungeonGen*, Allocator);
+void dungeonGenChunk(struct Map*, uint32_t chunk_x, uint32_t chunk_y,
+                     void* gen);
@@ -1,7 +1,10 @@
 #include "fov.h"
 
+#include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 
+#include "light.h"
 #include "maths.h"
 
 // todo draw the entire map into the tile indices buffer
@@ -9,32 +12,47 @@
 
 enum { NORTH = 0, EAST = 1, SOUTH = 2, WEST = 3 };
 
+/* a row at depth d spans at most 2d + 1 columns so it can push at most
+ * d + 1 rows, the stack only ever holds the unscanned siblings along
+ * one path of rows which keeps it well under this bound
+ */
+#define SHADOWCAST_STACK_MAX (FOV_RADIUS_MAX * (FOV_RADIUS_MAX + 5) / 2 + 1)
+
 struct Row {
-  struct MapPos camera;
-  int cardinal;
   int depth;
   Fraction start_slope;
   Fraction end_slope;
 };
 
-struct RenderClosure {
+struct RowStack {
+  int top;
+  int depth_max;
+  struct Row rows[SHADOWCAST_STACK_MAX];
+};
+
+static inline void rowPush(struct RowStack* stack, int depth, Fraction start,
+                           Fraction end) {
+  if (depth > stack->depth_max) return;
+  assert(stack->top < SHADOWCAST_STACK_MAX);
+  stack->rows[stack->top++] = (struct Row){depth, start, end};
+}
+
+/* writes every visited tile into a viewer centred visibility mask */
+struct MaskClosure {
   struct ShadowcastVTable_ vtable_;
-  TermCtx term;
-  int dx;
-  int dy;
+  Bitmap* mask;
+  uint32_t x0;
+  uint32_t y0;
 };
 
-void shadowcastRenderTile(ShadowcastVTable vtable_ptr, uint32_t x, uint32_t y,
-                          struct UnicodeTile t) {
-  struct RenderClosure* closure =
-      container_of(vtable_ptr, struct RenderClosure, vtable_);
+static void shadowcastMaskTile(ShadowcastVTable vtable_ptr, uint32_t x,
+                               uint32_t y) {
+  struct MaskClosure* closure =
+      container_of(vtable_ptr, struct MaskClosure, vtable_);
 
-  int scr_x = x - closure->dx;
-  int scr_y = y - closure->dy;
-  closure->term->atlas = t.atlas;
-  closure->term->fg = t.fg;
-  closure->term->bg = t.bg;
-  tileMvAdd(closure->term, scr_x, scr_y, t.unicode);
+  // unsigned subtraction keeps positions that wrapped past 0 in range
+  bitmapPutPx(closure->mask, (int32_t)(x - closure->x0),
+              (int32_t)(y - closure->y0), 1);
 }
 
 /* turns a shadowcast coordinate (row_depth,row_col)
@@ -102,132 +120,614 @@ static Fraction slope(int row_depth, int col) {
 
 /* returns true if the given position (col, row.depth)
  * modelled as a central point in tile space
- * is within the racycast arc
+ * is within the racycast arc, slopes are compared by
+ * cross multiplication so no division is needed
  */
 static bool isSymmetric(struct Row* row, int col) {
-  return (col >= frResolve(FR_MUL(row->depth, row->start_slope)) &&
-          col <= frResolve(FR_MUL(row->depth, row->end_slope)));
-}
-// replace maths functions with actual code and document here, very specific stuff
-// going on here
-
-static void shadowcastScanRow(struct Row cur_row, Bitmap* dst_mask,
-                              ShadowcastVTable vtable) {
-  static float SHADOWCAST_DEPTH_MAX = 12.5;
-  if (cur_row.depth > SHADOWCAST_DEPTH_MAX) return;
-
-  if(frCompare(cur_row.end_slope, cur_row.start_slope)) return;
-
-  // bounds each cast between two diamonds on a tiled grid
-  int min_col =
-      frRoundTiesUp(FR_MUL(cur_row.depth, cur_row.start_slope));
-  int max_col =
-      frRoundTiesDown(FR_MUL(cur_row.depth, cur_row.end_slope));
-
-  bool prev_was_wall = false;
-  for (int col = min_col; col <= max_col; col++) {
-    struct MapPos cur_pos = cur_row.camera;
-    shadowPosToMapPos(cur_row.cardinal, cur_row.depth, col, cur_row.camera,
-                      &cur_pos);
-
-    struct Terra terra = terraGet(cur_pos.map, cur_pos.x, cur_pos.y);
-    uint8_t is_wall = terra.blocks_move;
-    if (!is_wall || isSymmetric(&cur_row, col)) {
-      vtable->renderTile(vtable, cur_pos.x, cur_pos.y, terra.tile);
-      bitmapPutPx(dst_mask, cur_pos.x, cur_pos.y, 1);
-    } 
-    if (prev_was_wall && !is_wall) {
-      cur_row.start_slope = slope(cur_row.depth, col);
-    }
-    if (!prev_was_wall && is_wall) {
-      struct Row next_row = cur_row;
-      next_row.depth += 1;
-      next_row.end_slope = slope(cur_row.depth, col); 
-      shadowcastScanRow(next_row, dst_mask, vtable);
-    }
-    prev_was_wall = is_wall;
+  Fraction col_fr = {col, 1};
+  return (frCompare(FR_MUL(row->depth, row->start_slope), col_fr) &&
+          frCompare(col_fr, FR_MUL(row->depth, row->end_slope)));
+}
 
-  }  // end of row scanning
+/* scans the rows of one quadrant outward from the camera, rows that
+ * are still to be scanned wait on a fixed size stack instead of
+ * recursing once per row and once per wall
+ */
+static void shadowcastScan(struct FovGrid* grid, struct MapPos camera,
+                           int cardinal, struct Row first_row, uint32_t radius,
+                           ShadowcastVTable vtable) {
+  struct RowStack stack;
+  stack.top = 0;
+  stack.depth_max = iMin(radius, FOV_RADIUS_MAX);
+  rowPush(&stack, first_row.depth, first_row.start_slope, first_row.end_slope);
+
+  while (stack.top) {
+    struct Row cur_row = stack.rows[--stack.top];
+    if (frCompare(cur_row.end_slope, cur_row.start_slope)) continue;
+
+    /* bounds each cast between two diamonds on a tiled grid,
+     * rounding depth * slope to the nearest column in integer maths
+     */
+    int min_col = frRoundTiesUp(FR_MUL(cur_row.depth, cur_row.start_slope));
+    int max_col = frRoundTiesDown(FR_MUL(cur_row.depth, cur_row.end_slope));
+
+    bool prev_was_wall = false;
+    for (int col = min_col; col <= max_col; col++) {
+      struct MapPos cur_pos = camera;
+      shadowPosToMapPos(cardinal, cur_row.depth, col, camera, &cur_pos);
+
+      // outside of the grid reads as a wall
+      uint8_t is_wall =
+          bitmapGetPx(grid->opaque, (int32_t)(cur_pos.x - grid->x0),
+                      (int32_t)(cur_pos.y - grid->y0));
+      // walls are always seen, floors only when their centre is in
+      // the arc, which keeps floor to floor visibility symmetric
+      if (is_wall || isSymmetric(&cur_row, col)) {
+        vtable->visitTile(vtable, cur_pos.x, cur_pos.y);
+      }
+      if (prev_was_wall && !is_wall) {
+        cur_row.start_slope = slope(cur_row.depth, col);
+      }
+      if (!prev_was_wall && is_wall) {
+        rowPush(&stack, cur_row.depth + 1, cur_row.start_slope,
+                slope(cur_row.depth, col));
+      }
+      prev_was_wall = is_wall;
 
-  if (!prev_was_wall) {
-    struct Row next_row = cur_row;
-    next_row.depth += 1;
-    shadowcastScanRow(next_row, dst_mask, vtable);
+    }  // end of row scanning
+
+    if (!prev_was_wall) {
+      rowPush(&stack, cur_row.depth + 1, cur_row.start_slope,
+              cur_row.end_slope);
+    }
   }
+}
+
+struct FovGrid fovGridGather(struct Map* m, uint32_t x0, uint32_t y0,
+                             uint32_t w, uint32_t h, Allocator allocator) {
+  struct FovGrid grid = {bitmapCreate(w, h, allocator), x0, y0};
+  terraViewGather(m, x0, y0, grid.opaque);
+  return grid;
+}
 
-  return;
+void fovGridDestroy(struct FovGrid grid, Allocator allocator) {
+  bitmapDestroy(grid.opaque, allocator);
 }
 
-static void fovShadowcast(struct Map* m, uint32_t x_in, uint32_t y_in,
-                          Bitmap* dst_mask, ShadowcastVTable effect) {
-  struct Terra t = terraGet(m, x_in, y_in);
-  effect->renderTile(effect, x_in, y_in, t.tile);
-  bitmapPutPx(dst_mask, x_in, y_in, 1);
+void fovShadowcastGrid(struct FovGrid* grid, uint32_t x_in, uint32_t y_in,
+                       uint32_t radius, ShadowcastVTable effect) {
+  effect->visitTile(effect, x_in, y_in);
+  struct MapPos camera = {NULL, x_in, y_in};
   for (int cardinal = 0; cardinal < 4; cardinal++) {
-    struct Row first_row = {.camera = (struct MapPos){m, x_in, y_in},
-                            .cardinal = cardinal,
-                            .depth = 1,
+    struct Row first_row = {.depth = 1,
                             .start_slope = (Fraction){-1, 1},
                             .end_slope = (Fraction){1, 1}};
-    shadowcastScanRow(first_row, dst_mask, effect);
+    shadowcastScan(grid, camera, cardinal, first_row, radius, effect);
   }
 }
 
-void fovPortal(struct MapPos camera, struct Portal portal, Bitmap* dst_mask,
-               ShadowcastVTable effect) {
-  struct MapPos src = MAP_POS_INIT(camera.map, portal.hash_pos_entry.x,
-                                   portal.hash_pos_entry.y);
-  struct MapPos dst = MAP_POS_INIT(camera.map, portal.dst_x, portal.dst_y);
-  struct Terra t = terraGet(camera.map, portal.dst_x, portal.dst_y);
-  effect->renderTile(effect, dst.x, dst.y, t.tile);
-  bitmapFill(dst_mask, 0);
+/* gathers a grid just large enough for one cast from the calling
+ * thread's scratch arena
+ */
+void fovShadowcast(struct Map* m, uint32_t x_in, uint32_t y_in,
+                   uint32_t radius, ShadowcastVTable effect) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  Allocator scratch = threadArenaAllocator();
+  struct FovGrid grid = fovGridGather(m, x_in - radius, y_in - radius,
+                                      radius * 2 + 1, radius * 2 + 1, scratch);
+  fovShadowcastGrid(&grid, x_in, y_in, radius, effect);
+  fovGridDestroy(grid, scratch);
+}
+
+/* the tiles behind dst that show through the portal tile src are cast
+ * from an eye shifted by dst - src, starting on the row past the portal
+ * and inside the cone that src covers from the camera
+ */
+static void fovPortal(struct FovGrid* grid, struct MapPos camera,
+                      struct Portal* portal, uint32_t radius,
+                      ShadowcastVTable effect) {
+  struct MapPos src = MAP_POS_INIT(camera.map, portal->hash_pos_entry.x,
+                                   portal->hash_pos_entry.y);
+  struct MapPos dst = MAP_POS_INIT(camera.map, portal->dst_x, portal->dst_y);
+  struct MapPos eye = MAP_POS_INIT(camera.map, camera.x + (dst.x - src.x),
+                                   camera.y + (dst.y - src.y));
+  effect->visitTile(effect, dst.x, dst.y);
 
   bool second_solution = false;
   do {
     int cardinal, depth, col;
     worldPosToShadowPos(src, camera, &cardinal, &depth, &col, &second_solution);
     struct Row first_row = {
-        .camera = dst,
-        .cardinal = cardinal,
-        .depth = 1,
+        .depth = depth + 1,
         .start_slope = slope(depth, col),
         .end_slope = slope(depth, col + 1),
     };
-    shadowcastScanRow(first_row, dst_mask, effect);
+    shadowcastScan(grid, eye, cardinal, first_row, radius, effect);
   } while (second_solution);
 }
 
-int fovDrawWorld(TermCtx term, struct Map* m, uint32_t x_in, uint32_t y_in,
-                 Allocator allocator) {
-  int scr_width = TILE_BUFFER_WIDTH;//termGetScreenWidth(term);
-  int scr_height = TILE_BUFFER_WIDTH;//termGetScreenHeight(term);
+Bitmap* fovMaskCreate(uint32_t radius, Allocator allocator) {
+  return bitmapCreate(radius * 2 + 1, radius * 2 + 1, allocator);
+}
+
+static void fovComputeGrid(struct FovGrid* grid, uint32_t x, uint32_t y,
+                           uint32_t radius, Bitmap* out_mask) {
+  bitmapFill(out_mask, 0);
+
+  struct MaskClosure closure = {
+      .mask = out_mask,
+      .x0 = x - bitmapWidth(out_mask) / 2,
+      .y0 = y - bitmapHeight(out_mask) / 2,
+      .vtable_ = (struct ShadowcastVTable_){shadowcastMaskTile}};
+  fovShadowcastGrid(grid, x, y, radius, &closure.vtable_);
+}
+
+/* fills out_mask with the tiles visible from (x, y), nothing is drawn
+ * so the same mask can be shared by AI, lighting and rendering
+ */
+void fovCompute(struct Map* m, uint32_t x, uint32_t y, uint32_t radius,
+                Bitmap* out_mask) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  Allocator scratch = threadArenaAllocator();
+  struct FovGrid grid = fovGridGather(m, x - radius, y - radius,
+                                      radius * 2 + 1, radius * 2 + 1, scratch);
+  fovComputeGrid(&grid, x, y, radius, out_mask);
+  fovGridDestroy(grid, scratch);
+}
 
+/* records whether the single target tile was reached */
+struct LosClosure {
+  struct ShadowcastVTable_ vtable_;
+  uint32_t x;
+  uint32_t y;
+  bool seen;
+};
+
+static void losVisitTile(ShadowcastVTable vtable_ptr, uint32_t x,
+                         uint32_t y) {
+  struct LosClosure* closure =
+      container_of(vtable_ptr, struct LosClosure, vtable_);
+  if (x == closure->x && y == closure->y) closure->seen = true;
+}
+
+/* true when (bx, by) is in the mask fovCompute gives for (ax, ay).
+ * Only the cone of rays that reach the target tile is cast and only
+ * down to its depth, over a grid gathered around the box between the
+ * two points, a cone that is fully blocked ends the scan at once
+ */
+bool fovLineOfSight(struct Map* m, uint32_t ax, uint32_t ay, uint32_t bx,
+                    uint32_t by, uint32_t radius) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  int32_t dx = (int32_t)(bx - ax);
+  int32_t dy = (int32_t)(by - ay);
+  if ((uint32_t)abs(dx) > radius || (uint32_t)abs(dy) > radius) return false;
+  if (!dx && !dy) return true;
+
+  Allocator scratch = threadArenaAllocator();
+  struct FovGrid grid =
+      fovGridGather(m, ax + iMin(dx, 0) - 1, ay + iMin(dy, 0) - 1,
+                    abs(dx) + 3, abs(dy) + 3, scratch);
+  struct LosClosure closure = {
+      .x = bx, .y = by, .vtable_ = (struct ShadowcastVTable_){losVisitTile}};
+  struct MapPos camera = MAP_POS_INIT(m, ax, ay);
+  struct MapPos target = MAP_POS_INIT(m, bx, by);
+
+  // targets on a diagonal are reached from either of two quadrants
+  bool second_solution = false;
+  do {
+    int cardinal, depth, col;
+    worldPosToShadowPos(target, camera, &cardinal, &depth, &col,
+                        &second_solution);
+    struct Row first_row = {
+        .depth = 1,
+        .start_slope = slope(depth, col),
+        .end_slope = slope(depth, col + 1),
+    };
+    shadowcastScan(&grid, camera, cardinal, first_row, depth,
+                   &closure.vtable_);
+  } while (second_solution && !closure.seen);
+
+  fovGridDestroy(grid, scratch);
+  return closure.seen;
+}
+
+/* remembers every tile of a viewer centred mask as explored */
+void fovExplore(struct Map* m, uint32_t x, uint32_t y, Bitmap* mask) {
+  terraExplore(m, x - bitmapWidth(mask) / 2, y - bitmapHeight(mask) / 2,
+               mask);
+}
+
+/* finds the portals visible in one view and casts a child view through
+ * each of them, the portal a view was entered through is skipped so
+ * paired portals don't reflect straight back
+ */
+static struct FovPortalView* fovPortalScan(struct Map* m, uint32_t x,
+                                           uint32_t y, uint32_t radius,
+                                           struct FovPortalView parent,
+                                           struct FovPortalView* views,
+                                           Allocator allocator) {
+  Allocator scratch = threadArenaAllocator();
+  struct MapPos camera = {m, x + parent.dx, y + parent.dy};
+  int32_t w = bitmapWidth(parent.mask);
+  int32_t h = bitmapHeight(parent.mask);
+
+  struct HashPosSearch* iter = spatialHashSearch(
+      m->portals.hash, camera.x, camera.y, radius / PORTAL_CELL_LEN + 1,
+      &searchAll, NULL, scratch);
+  struct Portal* portal;
+  while ((portal = MAP_CAST(struct Portal, spatialHashSearchNext(iter)))) {
+    uint32_t px = portal->hash_pos_entry.x;
+    uint32_t py = portal->hash_pos_entry.y;
+    if (parent.portal && px == parent.portal->dst_x &&
+        py == parent.portal->dst_y)
+      continue;
+    if (px == camera.x && py == camera.y) continue;
+
+    int32_t mx = (int32_t)(px - camera.x) + w / 2;
+    int32_t my = (int32_t)(py - camera.y) + h / 2;
+    if (mx < 0 || mx >= w || my < 0 || my >= h ||
+        !bitmapGetPx(parent.mask, mx, my))
+      continue;
+
+    struct FovPortalView view = {
+        .portal = portal,
+        .dx = parent.dx + (int32_t)(portal->dst_x - px),
+        .dy = parent.dy + (int32_t)(portal->dst_y - py),
+        .depth = parent.depth + 1,
+    };
+
+    // search cells that share a bucket return the same portal again
+    bool seen = false;
+    for (size_t i = 0; i < fatPtrC(views); i++) {
+      seen |= views[i].portal == portal && views[i].dx == view.dx &&
+              views[i].dy == view.dy;
+    }
+    if (seen) continue;
+    if (fatPtrC(views) == FOV_PORTAL_VIEWS_MAX) break;
+
+    view.mask = bitmapCreate(w, h, allocator);
+    bitmapFill(view.mask, 0);
+    struct MaskClosure closure = {
+        .mask = view.mask,
+        .x0 = x + view.dx - w / 2,
+        .y0 = y + view.dy - h / 2,
+        .vtable_ = (struct ShadowcastVTable_){shadowcastMaskTile}};
+
+    struct FovGrid grid =
+        fovGridGather(m, x + view.dx - radius, y + view.dy - radius,
+                      radius * 2 + 1, radius * 2 + 1, scratch);
+    fovPortal(&grid, camera, portal, radius, &closure.vtable_);
+    fovGridDestroy(grid, scratch);
+
+    fatPtrPush(views, view, allocator);
+  }
+
+  spatialHashSearchEnd(iter, scratch);
+  return views;
+}
+
+/* views are expanded breadth first so the nearest portals are cast
+ * before the budget on depth or view count runs out
+ */
+struct FovPortalView* fovComputePortals(struct Map* m, uint32_t x, uint32_t y,
+                                        uint32_t radius, Bitmap* mask,
+                                        uint32_t depth_budget,
+                                        Allocator allocator) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  struct FovPortalView* views =
+      fatPtrCreate(0, sizeof(struct FovPortalView), allocator);
+  // reserved up front so pushes never move the array past the masks
+  views = fatPtrReserve(views, FOV_PORTAL_VIEWS_MAX, allocator);
+
+  struct FovPortalView parent = {.mask = mask};
+  for (size_t i = 0;; i++) {
+    if (parent.depth < depth_budget)
+      views = fovPortalScan(m, x, y, radius, parent, views, allocator);
+    if (i == fatPtrC(views)) break;
+    parent = views[i];
+  }
+  return views;
+}
+
+void fovPortalViewsDestroy(struct FovPortalView* views, Allocator allocator) {
+  for (size_t i = fatPtrC(views); i-- > 0;) {
+    bitmapDestroy(views[i].mask, allocator);
+  }
+  fatPtrDestroy(views, allocator);
+}
+
+struct FovCache* fovCacheCreate(struct Map* m, uint32_t radius,
+                                Allocator allocator) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  struct FovCache* cache = allocator->mallocFn(allocator, sizeof(*cache));
+  cache->watch.radius = radius;
+  cache->valid = false;
+  cache->mask = fovMaskCreate(radius, allocator);
+  cache->portal_depth = FOV_PORTAL_DEPTH_DEFAULT;
+  cache->portal_arena = arenaCreate(FOV_PORTAL_RAM_SIZE, NULL);
+  cache->portals = NULL;
+  cache->explore = false;
+  cache->algorithm = FOV_SHADOWCAST;
+  mapWatchAdd(m, &cache->watch);
+  return cache;
+}
+
+void fovCacheDestroy(struct FovCache* cache, struct Map* m,
+                     Allocator allocator) {
+  mapWatchRemove(m, &cache->watch);
+  if (cache->portals)
+    fovPortalViewsDestroy(cache->portals, cache->portal_arena);
+  arenaDestroy(cache->portal_arena);
+  bitmapDestroy(cache->mask, allocator);
+  allocator->freeFn(allocator, cache);
+}
+
+/* the cache is keyed on the viewer position and the revision of its
+ * map watch, which only changes for edits within the radius, portal
+ * views look at far away tiles so while there are any they are also
+ * recast whenever the map revision moves
+ */
+Bitmap* fovCacheGet(struct FovCache* cache, struct Map* m, uint32_t x,
+                    uint32_t y) {
+  bool mask_valid = cache->valid && cache->watch.x == x &&
+                    cache->watch.y == y &&
+                    cache->watch.revision == cache->revision;
+  if (mask_valid &&
+      (!fatPtrC(cache->portals) || cache->map_revision == m->revision))
+    return cache->mask;
+
+  if (!mask_valid) {
+    cache->watch.x = x;
+    cache->watch.y = y;
+    fovComputeWith(cache->algorithm, m, x, y, cache->watch.radius,
+                   cache->mask);
+    if (cache->explore) fovExplore(m, x, y, cache->mask);
+    cache->revision = cache->watch.revision;
+    cache->valid = true;
+  }
+
+  if (cache->portals)
+    fovPortalViewsDestroy(cache->portals, cache->portal_arena);
+  cache->portals =
+      fovComputePortals(m, x, y, cache->watch.radius, cache->mask,
+                        cache->portal_depth, cache->portal_arena);
+  cache->map_revision = m->revision;
+  return cache->mask;
+}
+
+struct FovBatchJob {
+  pthread_t thread;
+  bool started;
+  struct FovGrid** grids;  // by viewer
+  struct FovViewer* viewers;
+  Bitmap** masks;
+  size_t first;
+  size_t count;
+  size_t step;
+  uint32_t radius;
+};
+
+static void* fovBatchWork(void* arg) {
+  struct FovBatchJob* job = arg;
+  for (size_t i = job->first; i < job->count; i += job->step) {
+    fovComputeGrid(job->grids[i], job->viewers[i].x, job->viewers[i].y,
+                   job->radius, job->masks[i]);
+  }
+  return NULL;
+}
+
+struct FovBatchEntry {
+  uint32_t block_x;
+  uint32_t block_y;
+  size_t viewer;
+};
+
+static int fovBatchCompare(const void* a_ptr, const void* b_ptr) {
+  const struct FovBatchEntry* a = a_ptr;
+  const struct FovBatchEntry* b = b_ptr;
+  if (a->block_y != b->block_y) return a->block_y < b->block_y ? -1 : 1;
+  if (a->block_x != b->block_x) return a->block_x < b->block_x ? -1 : 1;
+  return a->viewer < b->viewer ? -1 : a->viewer > b->viewer;
+}
+
+/* the grid around entries [first, end), which share a block, its box
+ * is taken relative to the first viewer so it tolerates wrapping
+ */
+static struct FovGrid fovBatchGather(struct Map* m, struct FovViewer* viewers,
+                                     struct FovBatchEntry* entries,
+                                     size_t first, size_t end, uint32_t radius,
+                                     Allocator allocator) {
+  struct FovViewer origin = viewers[entries[first].viewer];
+  int32_t min_dx = 0, max_dx = 0, min_dy = 0, max_dy = 0;
+  for (size_t i = first + 1; i < end; i++) {
+    int32_t dx = (int32_t)(viewers[entries[i].viewer].x - origin.x);
+    int32_t dy = (int32_t)(viewers[entries[i].viewer].y - origin.y);
+    min_dx = iMin(min_dx, dx);
+    max_dx = iMax(max_dx, dx);
+    min_dy = iMin(min_dy, dy);
+    max_dy = iMax(max_dy, dy);
+  }
+
+  return fovGridGather(m, origin.x + min_dx - radius,
+                       origin.y + min_dy - radius,
+                       max_dx - min_dx + radius * 2 + 1,
+                       max_dy - min_dy + radius * 2 + 1, allocator);
+}
+
+/* viewers are interleaved over the threads, the calling thread takes
+ * the first share and any share whose thread failed to start, grids
+ * are all gathered up front as the allocator isn't shared
+ */
+void fovComputeBatch(struct Map* m, struct FovViewer* viewers, size_t count,
+                     uint32_t radius, Bitmap** out_masks, int thread_count,
+                     Allocator allocator) {
+  if (!count) return;
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  if (thread_count < 1) thread_count = 1;
+  if ((size_t)thread_count > count) thread_count = count;
+
+  struct FovBatchEntry* entries =
+      allocator->mallocFn(allocator, sizeof(*entries) * count);
+  for (size_t i = 0; i < count; i++) {
+    entries[i] = (struct FovBatchEntry){viewers[i].x / FOV_BATCH_BLOCK_LEN,
+                                        viewers[i].y / FOV_BATCH_BLOCK_LEN, i};
+  }
+  qsort(entries, count, sizeof(*entries), fovBatchCompare);
+
+  struct FovGrid* block_grids =
+      allocator->mallocFn(allocator, sizeof(*block_grids) * count);
+  struct FovGrid** grids =
+      allocator->mallocFn(allocator, sizeof(*grids) * count);
+  size_t block_count = 0;
+  for (size_t first = 0, end; first < count; first = end) {
+    for (end = first + 1; end < count &&
+                          entries[end].block_x == entries[first].block_x &&
+                          entries[end].block_y == entries[first].block_y;
+         end++) {
+    }
+    block_grids[block_count] =
+        fovBatchGather(m, viewers, entries, first, end, radius, allocator);
+    for (size_t i = first; i < end; i++)
+      grids[entries[i].viewer] = &block_grids[block_count];
+    block_count++;
+  }
+
+  struct FovBatchJob* jobs =
+      allocator->mallocFn(allocator, sizeof(struct FovBatchJob) * thread_count);
+  for (int t = 0; t < thread_count; t++) {
+    jobs[t] = (struct FovBatchJob){.grids = grids,
+                                   .viewers = viewers,
+                                   .masks = out_masks,
+                                   .first = t,
+                                   .count = count,
+                                   .step = thread_count,
+                                   .radius = radius};
+    if (t)
+      jobs[t].started =
+          !pthread_create(&jobs[t].thread, NULL, fovBatchWork, &jobs[t]);
+  }
+
+  fovBatchWork(&jobs[0]);
+  for (int t = 1; t < thread_count; t++) {
+    if (jobs[t].started)
+      pthread_join(jobs[t].thread, NULL);
+    else
+      fovBatchWork(&jobs[t]);
+  }
+
+  allocator->freeFn(allocator, jobs);
+  while (block_count) fovGridDestroy(block_grids[--block_count], allocator);
+  allocator->freeFn(allocator, grids);
+  allocator->freeFn(allocator, block_grids);
+  allocator->freeFn(allocator, entries);
+}
+
+/* draws the screen around (x, y) through a mask whose tiles are
+ * offset by (ox, oy) in the world, visible tiles are shaded by the
+ * light map when one is given
+ *
+ * hidden tiles are only drawn when draw_hidden is set so views can be
+ * layered, explored ones are remembered in the darkest shade of their
+ * colours and the rest are blanked without querying the terrain
+ */
+static void fovRenderView(TermCtx term, struct Map* m, uint32_t x_in,
+                          uint32_t y_in, Bitmap* mask, int32_t ox, int32_t oy,
+                          bool draw_hidden, struct LightMap* light) {
   int dx = x_in - (TILE_BUFFER_WIDTH / 2);
   int dy = y_in - (TILE_BUFFER_WIDTH / 2);
+  int mask_w = bitmapWidth(mask);
+  int mask_h = bitmapHeight(mask);
+  int mask_dx = (TILE_BUFFER_WIDTH / 2) - (mask_w / 2);
+  int mask_dy = (TILE_BUFFER_WIDTH / 2) - (mask_h / 2);
+
+  Allocator scratch = threadArenaAllocator();
+  Bitmap* explored = NULL;
+  if (draw_hidden) {
+    explored = bitmapCreate(TILE_BUFFER_WIDTH, TILE_BUFFER_WIDTH, scratch);
+    terraExploredGather(m, dx + ox, dy + oy, explored);
+  }
+
+  for (int y = 0; y < TILE_BUFFER_WIDTH; y++) {
+    for (int x = 0; x < TILE_BUFFER_WIDTH; x++) {
+      int mx = x - mask_dx;
+      int my = y - mask_dy;
+      bool visible = mx >= 0 && mx < mask_w && my >= 0 && my < mask_h &&
+                     bitmapGetPx(mask, mx, my);
+      if (!visible && !draw_hidden) continue;
+      if (!visible && !bitmapGetPx(explored, x, y)) {
+        term->fg = 0;
+        term->bg = 0;
+        tileMvAdd(term, x, y, 0);
+        continue;
+      }
 
-  for(int y = 0; y < TILE_BUFFER_WIDTH; y++){
-    for(int x = 0; x < TILE_BUFFER_WIDTH; x++){
-      struct Terra t = terraGet(m, dx + x, dy +y);
-      term->fg = 0;
-      term->bg= 0;
-      tileMvAdd(term, x, y, t.tile.unicode); 
+      uint32_t wx = dx + x + ox;
+      uint32_t wy = dy + y + oy;
+      struct Terra t = terraGet(m, wx, wy);
+      term->atlas = t.tile.atlas;
+      if (!visible) {
+        term->fg = lightShade(t.tile.fg, 0);
+        term->bg = lightShade(t.tile.bg, 0);
+      } else if (light) {
+        uint16_t level = lightGet(light, wx, wy);
+        term->fg = lightShade(t.tile.fg, level);
+        term->bg = lightShade(t.tile.bg, level);
+      } else {
+        term->fg = t.tile.fg;
+        term->bg = t.tile.bg;
+      }
+      tileMvAdd(term, x, y, t.tile.unicode);
     }
   }
- 
-  struct RenderClosure closure = {
-      .term = term,
-      .dx = dx,
-      .dy = dy,
-      .vtable_ = (struct ShadowcastVTable_){shadowcastRenderTile}};
-  ShadowcastVTable effects = &closure.vtable_;
+
+  if (explored) bitmapDestroy(explored, scratch);
+}
+
+/* draws the screen around (x, y), tiles in the mask are drawn in
+ * their own colours, explored ones dimmed and the rest blacked out
+ */
+void fovRender(TermCtx term, struct Map* m, uint32_t x_in, uint32_t y_in,
+               Bitmap* mask) {
+  fovRenderView(term, m, x_in, y_in, mask, 0, 0, true, NULL);
+}
+
+/* as fovRender but visible tiles are shaded by their light level */
+void fovRenderLit(TermCtx term, struct Map* m, uint32_t x_in, uint32_t y_in,
+                  Bitmap* mask, struct LightMap* light) {
+  fovRenderView(term, m, x_in, y_in, mask, 0, 0, true, light);
+}
+
+/* layers each portal view over the screen drawn by fovRender, light
+ * may be NULL to draw the views unlit
+ */
+void fovRenderPortals(TermCtx term, struct Map* m, uint32_t x_in,
+                      uint32_t y_in, struct FovPortalView* views,
+                      struct LightMap* light) {
+  for (size_t i = 0; i < fatPtrC(views); i++) {
+    fovRenderView(term, m, x_in, y_in, views[i].mask, views[i].dx,
+                  views[i].dy, false, light);
+  }
+}
+
+int fovDrawWorld(TermCtx term, struct Map* m, uint32_t x_in, uint32_t y_in,
+                 Allocator allocator) {
+  int scr_width = TILE_BUFFER_WIDTH;//termGetScreenWidth(term);
+  int scr_height = TILE_BUFFER_WIDTH;//termGetScreenHeight(term);
 
   /* First chunk rendering pass
-   * draws terrain to2 the screen and a visibility mask
-   * bmp, this can be used to occlude sparse object data
-   * on following passes.
+   * computes a visibility mask bmp, then draws terrain
+   * to the screen through it, the mask can be used to
+   * occlude sparse object data on following passes.
    */
-  Bitmap* mask = bitmapCreate(scr_width, scr_height, allocator); 
-  fovShadowcast(m, x_in, y_in, mask, effects);
+  Bitmap* mask = bitmapCreate(scr_width, scr_height, allocator);
+  fovCompute(m, x_in, y_in, FOV_RADIUS_DEFAULT, mask);
+  fovExplore(m, x_in, y_in, mask);
+  fovRender(term, m, x_in, y_in, mask);
+  struct FovPortalView* views =
+      fovComputePortals(m, x_in, y_in, FOV_RADIUS_DEFAULT, mask,
+                        FOV_PORTAL_DEPTH_DEFAULT, allocator);
+  fovRenderPortals(term, m, x_in, y_in, views, NULL);
+  fovPortalViewsDestroy(views, allocator);
   //termDrawPushZ(term);
 
  
@@ -245,23 +745,6 @@ int fovDrawWorld(TermCtx term, struct Map* m, uint32_t x_in, uint32_t y_in,
   */
   //termDrawPushZ(term);
 
- 
-  /*
-  struct Portal* portal;
-  iter = MAP_SEARCH(camera, portals, 1, allocator);
-  while((portal = MAP_CAST(struct Portal, spatialHashSearchNext(iter)))){
-      if (bitmapGetPx(mask, portal->src.x, portal->src.y) == 1){
-          closure.dx = dx + portal->dst_x - portal->hash_pos_entry.x;
-          closure.dy = dy + portal->dst_y - portal->hash_pos_entry.y;
-          fovPortal(camera, *portal, mask, effects);
-      }
-
-  }
-  */
-  
-  // spatialHashSearchEnd(iter, allocator);
-  //termDrawPushZ(term);
-
   bitmapDestroy(mask, allocator);
   return 0;
 }
@@ -4,11 +4,133 @@
 #include "bios.h"
 
 #define FOV_ALLOCATOR_RAM_SIZE (1 * KB)
+#define FOV_RADIUS_DEFAULT 12
+#define FOV_RADIUS_MAX 32
+#define FOV_PORTAL_RAM_SIZE (16 * KB)
+#define FOV_PORTAL_DEPTH_DEFAULT 2
+#define FOV_PORTAL_VIEWS_MAX 16
+#define FOV_BATCH_BLOCK_LEN (4 * CHUNK_LEN)
 
+/* called once for every tile a shadowcast finds visible */
 typedef struct ShadowcastVTable_* ShadowcastVTable;
 struct ShadowcastVTable_ {
-  void (*renderTile)(ShadowcastVTable, uint32_t x, uint32_t y,
-                     struct UnicodeTile);
+  void (*visitTile)(ShadowcastVTable, uint32_t x, uint32_t y);
 };
 
+void fovShadowcast(struct Map*, uint32_t, uint32_t, uint32_t radius,
+                   ShadowcastVTable);
+
+/*
+ * Opacity grids
+ * a dense copy of blocks_view over a world rectangle, gathered one
+ * chunk at a time and read by the shadowcast core instead of the map
+ */
+struct FovGrid {
+  Bitmap* opaque;
+  uint32_t x0;
+  uint32_t y0;
+};
+
+struct FovGrid fovGridGather(struct Map*, uint32_t x0, uint32_t y0,
+                             uint32_t w, uint32_t h, Allocator);
+void fovGridDestroy(struct FovGrid, Allocator);
+void fovShadowcastGrid(struct FovGrid*, uint32_t, uint32_t, uint32_t radius,
+                       ShadowcastVTable);
+
+/*
+ * Visibility masks
+ * masks are centred on the viewer, pixel (mx, my) of a w * h mask
+ * is the world tile (x - w / 2 + mx, y - h / 2 + my)
+ */
+Bitmap* fovMaskCreate(uint32_t radius, Allocator);
+void fovCompute(struct Map*, uint32_t x, uint32_t y, uint32_t radius,
+                Bitmap* out_mask);
+void fovExplore(struct Map*, uint32_t x, uint32_t y, Bitmap* mask);
+bool fovLineOfSight(struct Map*, uint32_t ax, uint32_t ay, uint32_t bx,
+                    uint32_t by, uint32_t radius);
+
+/*
+ * FOV algorithms
+ * shadowcasting is the default, the raycast alternative tests two
+ * precomputed rays per target against the bit-packed opacity grid
+ * with the widest vector path the cpu supports, or the one asked for
+ */
+enum FovAlgorithm {
+  FOV_SHADOWCAST,
+  FOV_RAYCAST,
+  FOV_RAYCAST_SCALAR,
+  FOV_RAYCAST_SSE2,
+  FOV_RAYCAST_AVX2,
+  FOV_ALGORITHM_COUNT,
+};
+
+bool fovAlgorithmSupported(enum FovAlgorithm);
+void fovComputeWith(enum FovAlgorithm, struct Map*, uint32_t x, uint32_t y,
+                    uint32_t radius, Bitmap* out_mask);
+struct LightMap;
+void fovRender(TermCtx, struct Map*, uint32_t, uint32_t, Bitmap*);
+void fovRenderLit(TermCtx, struct Map*, uint32_t, uint32_t, Bitmap*,
+                  struct LightMap*);
 int fovDrawWorld(TermCtx, struct Map*, uint32_t, uint32_t, Allocator);
+
+/*
+ * Portal views
+ * each visible portal is looked through with a cast from its
+ * destination, a view's mask is centred on the viewer like the main
+ * mask but its tiles are read from the world offset by (dx, dy)
+ * views nest at most depth_budget portals deep and there are never
+ * more than FOV_PORTAL_VIEWS_MAX of them
+ */
+struct FovPortalView {
+  struct Portal* portal;
+  int32_t dx;
+  int32_t dy;
+  uint32_t depth;
+  Bitmap* mask;
+};
+
+struct FovPortalView* fovComputePortals(struct Map*, uint32_t x, uint32_t y,
+                                        uint32_t radius, Bitmap* mask,
+                                        uint32_t depth_budget, Allocator);
+void fovPortalViewsDestroy(struct FovPortalView*, Allocator);
+void fovRenderPortals(TermCtx, struct Map*, uint32_t, uint32_t,
+                      struct FovPortalView*, struct LightMap*);
+
+/*
+ * Cached FOV
+ * the mask is only recomputed when the viewer moves or a terraPut
+ * lands inside the cached radius, idle frames do no FOV work
+ * with explore set every recomputed mask is also remembered as explored
+ */
+struct FovCache {
+  struct MapWatch watch;
+  uint32_t revision;
+  bool valid;
+  bool explore;
+  enum FovAlgorithm algorithm;
+  Bitmap* mask;
+  uint32_t portal_depth;
+  uint32_t map_revision;
+  Allocator portal_arena;
+  struct FovPortalView* portals;
+};
+
+struct FovCache* fovCacheCreate(struct Map*, uint32_t radius, Allocator);
+void fovCacheDestroy(struct FovCache*, struct Map*, Allocator);
+Bitmap* fovCacheGet(struct FovCache*, struct Map*, uint32_t, uint32_t);
+
+/*
+ * Batch FOV
+ * viewers standing in the same FOV_BATCH_BLOCK_LEN square share one
+ * opacity grid gathered around them, so grids stay bounded by the block
+ * and the radius however far apart the viewers are, the casts are
+ * split over thread_count threads
+ */
+struct FovViewer {
+  uint32_t x;
+  uint32_t y;
+};
+
+void fovComputeBatch(struct Map*, struct FovViewer*, size_t count,
+                     uint32_t radius, Bitmap** out_masks, int thread_count,
+                     Allocator);
@@ -0,0 +1,181 @@
+#include "light.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fov.h"
+#include "maths.h"
+
+struct LightChunk {
+  HASH_POS_ENTRY;
+  uint32_t lit;  // levels that aren't zero
+  uint16_t level[CHUNK_AREA];
+};
+
+/* the palette entry closest to each colour at about half brightness,
+ * picked from textures/color.png by luminance
+ */
+static const uint8_t LIGHT_DIM_COLOUR[16] = {0, 0, 12, 12, 1, 4, 1,  4,
+                                             6, 6, 6,  2,  1, 4, 4, 14};
+
+struct LightMap* lightMapCreate(Allocator allocator) {
+  struct LightMap* lm = allocator->mallocFn(allocator, sizeof(*lm));
+  lm->arena = allocator;
+  lm->chunks = mapPoolCreate(64, 1, allocator);
+  SLIST_INIT_HEAD(&lm->lights);
+  SLIST_INIT_HEAD(&lm->free_list);
+  return lm;
+}
+
+/* chunks and lights live in the light map's allocator and are freed
+ * with it, only the map watches need unhooking
+ */
+void lightMapDestroy(struct LightMap* lm, struct Map* m) {
+  struct Light* light;
+  SLIST_FOREACH(light, &lm->lights, entry) {
+    mapWatchRemove(m, &light->watch);
+  }
+  spatialHashDestroy(lm->chunks.hash, lm->arena);
+  lm->arena->freeFn(lm->arena, lm);
+}
+
+static struct LightChunk* lightChunkGet(struct LightMap* lm, uint32_t cx,
+                                        uint32_t cy) {
+  struct LightChunk* chunk = SHASH_GET(lm->chunks.hash, struct LightChunk,
+                                       cx, cy);
+  if (chunk) return chunk;
+
+  chunk = mapPoolMallocFn(&lm->chunks, sizeof(struct LightChunk),
+                          offsetof(struct LightChunk, hash_pos_entry), cx, cy,
+                          lm->arena);
+  chunk->lit = 0;
+  memset(chunk->level, 0, sizeof(chunk->level));
+  return chunk;
+}
+
+/* linear falloff over an octagonal distance so lights look round */
+static uint16_t lightFalloff(struct Light* light, int32_t dx, int32_t dy) {
+  uint32_t ax = abs(dx);
+  uint32_t ay = abs(dy);
+  uint32_t dist = ax > ay ? ax + ay / 2 : ay + ax / 2;
+  uint32_t span = light->watch.radius + 1;
+  if (dist >= span) return 0;
+  return light->intensity * (span - dist) / span;
+}
+
+/* adds or subtracts the light's contribution at its applied position,
+ * walking the mask one chunk sized span at a time so each light chunk
+ * is looked up once per span, a chunk left all dark goes back to the
+ * pool so a streamed world only holds chunks near lights
+ */
+static void lightApply(struct LightMap* lm, struct Light* light, bool add) {
+  Bitmap* mask = light->mask;
+  uint32_t w = bitmapWidth(mask);
+  uint32_t h = bitmapHeight(mask);
+  uint32_t x0 = light->applied_x - w / 2;
+  uint32_t y0 = light->applied_y - h / 2;
+
+  uint32_t span_h;
+  for (uint32_t r = 0; r < h; r += span_h) {
+    uint32_t y = y0 + r;
+    span_h = iMin(CHUNK_LEN - (y % CHUNK_LEN), h - r);
+
+    uint32_t span_w;
+    for (uint32_t c = 0; c < w; c += span_w) {
+      uint32_t x = x0 + c;
+      span_w = iMin(CHUNK_LEN - (x % CHUNK_LEN), w - c);
+
+      struct LightChunk* chunk = NULL;
+      for (uint32_t j = 0; j < span_h; j++) {
+        for (uint32_t i = 0; i < span_w; i++) {
+          if (!bitmapGetPx(mask, c + i, r + j)) continue;
+          uint16_t level = lightFalloff(light, (int32_t)(c + i - w / 2),
+                                        (int32_t)(r + j - h / 2));
+          if (!level) continue;
+
+          if (!chunk)
+            chunk = lightChunkGet(lm, x / CHUNK_LEN, y / CHUNK_LEN);
+          uint16_t* cell = &chunk->level[((y % CHUNK_LEN) + j) * CHUNK_LEN +
+                                         (x % CHUNK_LEN) + i];
+          chunk->lit -= *cell != 0;
+          *cell = add ? *cell + level : *cell - level;
+          chunk->lit += *cell != 0;
+        }
+      }
+      if (chunk && !chunk->lit)
+        mapPoolFree(&lm->chunks, &chunk->hash_pos_entry);
+    }
+  }
+}
+
+/* recasts only the lights whose position or watch revision changed */
+void lightMapUpdate(struct LightMap* lm, struct Map* m) {
+  struct Light* light;
+  SLIST_FOREACH(light, &lm->lights, entry) {
+    if (light->applied && light->applied_x == light->watch.x &&
+        light->applied_y == light->watch.y &&
+        light->revision == light->watch.revision)
+      continue;
+
+    if (light->applied) lightApply(lm, light, false);
+    light->applied_x = light->watch.x;
+    light->applied_y = light->watch.y;
+    light->revision = light->watch.revision;
+    fovCompute(m, light->applied_x, light->applied_y, light->watch.radius,
+               light->mask);
+    lightApply(lm, light, true);
+    light->applied = true;
+  }
+}
+
+struct Light* lightCreate(struct LightMap* lm, struct Map* m, uint32_t x,
+                          uint32_t y, uint32_t radius, uint16_t intensity) {
+  struct Light* light = SLIST_FIRST(&lm->free_list);
+  if (light) {
+    SLIST_REMOVE_HEAD(&lm->free_list, entry);
+  } else {
+    light = lm->arena->mallocFn(lm->arena, sizeof(*light));
+    light->mask = fovMaskCreate(LIGHT_RADIUS_MAX, lm->arena);
+  }
+
+  light->watch.x = x;
+  light->watch.y = y;
+  light->watch.radius = iMin(radius, LIGHT_RADIUS_MAX);
+  light->intensity = iMin(intensity, LIGHT_LEVEL_MAX);
+  light->applied = false;
+  mapWatchAdd(m, &light->watch);
+  SLIST_INSERT_HEAD(&lm->lights, light, entry);
+  return light;
+}
+
+void lightDestroy(struct LightMap* lm, struct Map* m, struct Light* light) {
+  if (light->applied) lightApply(lm, light, false);
+  mapWatchRemove(m, &light->watch);
+  SLIST_REMOVE(&lm->lights, light, struct Light, entry);
+  SLIST_INSERT_HEAD(&lm->free_list, light, entry);
+}
+
+/* the watch follows the light so edits are tracked around where it
+ * is now, the recast waits for the next lightMapUpdate
+ */
+void lightMove(struct Light* light, uint32_t x, uint32_t y) {
+  light->watch.x = x;
+  light->watch.y = y;
+}
+
+uint16_t lightGet(struct LightMap* lm, uint32_t x, uint32_t y) {
+  struct LightChunk* chunk = SHASH_GET(lm->chunks.hash, struct LightChunk,
+                                       x / CHUNK_LEN, y / CHUNK_LEN);
+  if (!chunk) return 0;
+  return chunk->level[(y % CHUNK_LEN) * CHUNK_LEN + (x % CHUNK_LEN)];
+}
+
+/* bright tiles keep their colour, dimmer ones step down the palette
+ * once or twice
+ */
+uint8_t lightShade(uint8_t colour, uint16_t level) {
+  if (level >= LIGHT_LEVEL_BRIGHT) return colour;
+  colour = LIGHT_DIM_COLOUR[colour % 16];
+  if (level >= LIGHT_LEVEL_DIM) return colour;
+  return LIGHT_DIM_COLOUR[colour];
+}
@@ -0,0 +1,55 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "map.h"
+
+#define LIGHT_ALLOCATOR_RAM_SIZE (1 * MB)
+#define LIGHT_RADIUS_DEFAULT 8
+#define LIGHT_RADIUS_MAX 16
+#define LIGHT_LEVEL_MAX 255
+#define LIGHT_LEVEL_BRIGHT 128
+#define LIGHT_LEVEL_DIM 48
+
+/*
+ * Lights
+ * each light is a shadowcast from its position whose lit tiles add a
+ * falloff to the per-chunk light buffers, levels are summed in wrapping
+ * uint16 so a contribution is removed exactly by subtracting it again
+ *
+ * a light is only recast when it has moved or when its map watch saw
+ * an edit within its radius, lights that stay put cost nothing after
+ * their first update and moving lights are recast only on frames they
+ * move, every recast subtracts the old contribution and adds the new
+ */
+struct Light {
+  SLIST_ENTRY(struct Light) entry;
+  struct MapWatch watch;
+  uint32_t revision;
+  uint16_t intensity;
+  bool applied;
+  uint32_t applied_x;
+  uint32_t applied_y;
+  Bitmap* mask;
+};
+SLIST_HEAD(LightHead, struct Light);
+
+struct LightMap {
+  Allocator arena;
+  struct MapPool chunks;
+  struct LightHead lights;
+  struct LightHead free_list;
+};
+
+struct LightMap* lightMapCreate(Allocator);
+void lightMapDestroy(struct LightMap*, struct Map*);
+void lightMapUpdate(struct LightMap*, struct Map*);
+
+struct Light* lightCreate(struct LightMap*, struct Map*, uint32_t x,
+                          uint32_t y, uint32_t radius, uint16_t intensity);
+void lightDestroy(struct LightMap*, struct Map*, struct Light*);
+void lightMove(struct Light*, uint32_t x, uint32_t y);
+
+uint16_t lightGet(struct LightMap*, uint32_t x, uint32_t y);
+uint8_t lightShade(uint8_t colour, uint16_t level);
+
+#endif  // LIGHT_H
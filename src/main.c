@@ -1,6 +1,17 @@
 #include "main.h"
 
-int main(void) {
+#include <string.h>
+#include <time.h>
+
+int main(int argc, char** argv) {
+  if (argc > 1 && !strcmp(argv[1], "--bench-fov")) {
+    benchFov();
+    return 0;
+  }
+  if (argc > 1 && !strcmp(argv[1], "--test-fov")) {
+    return benchFovTest() ? 1 : 0;
+  }
+
   TermCtx term = termCtxCreate(
           TILE_BUFFER_WIDTH,
           TILE_BUFFER_WIDTH);
@@ -11,7 +22,9 @@ int main(void) {
   
   Allocator arena = arenaCreate(10 * MB, NULL);
   struct Map map = mapCreate(arena);
-  dungeonBuild(&map);
+  struct DungeonGen *dungeon = dungeonGenCreate((uint32_t)time(NULL), arena);
+  mapGeneratorSet(&map, dungeonGenChunk, dungeon);
+  mapGenerateAround(&map, 3, 3, DUNGEON_GEN_RADIUS);
 
   struct Mobile *player = mobCreate(map, 3, 3);
   mobName(player, "player");
@@ -27,10 +40,19 @@ int main(void) {
   goblin->tile.unicode = 907;
   goblin->tile.atlas = 2;
 
-  portalCreate(map, 0, 0, 16, 16);
-  portalCreate(map, 16, 16, 0, 0);
+  portalCreate(&map, 0, 0, 16, 16);
+  portalCreate(&map, 16, 16, 0, 0);
 
   Allocator fov_allocator = arenaCreate(FOV_ALLOCATOR_RAM_SIZE, NULL);
+  struct FovCache *player_fov =
+      fovCacheCreate(&map, FOV_RADIUS_DEFAULT, fov_allocator);
+  player_fov->explore = true;
+
+  Allocator light_allocator = arenaCreate(LIGHT_ALLOCATOR_RAM_SIZE, NULL);
+  struct LightMap *lights = lightMapCreate(light_allocator);
+  struct Light *torch =
+      lightCreate(lights, &map, 3, 3, LIGHT_RADIUS_DEFAULT, LIGHT_LEVEL_MAX);
+  lightCreate(lights, &map, 16, 16, LIGHT_RADIUS_DEFAULT, LIGHT_LEVEL_BRIGHT);
 
   term->layer = 1;
   tilePrint(term, "test");
@@ -51,13 +73,24 @@ int main(void) {
 
 
 
-    fovDrawWorld(term, &map, player->hash_pos_entry.x, player->hash_pos_entry.y, fov_allocator);
+    uint32_t px = player->hash_pos_entry.x;
+    uint32_t py = player->hash_pos_entry.y;
+    mapGenerateAround(&map, px, py, DUNGEON_GEN_RADIUS);
+    lightMove(torch, px, py);
+    lightMapUpdate(lights, &map);
+    Bitmap *mask = fovCacheGet(player_fov, &map, px, py);
+    fovRenderLit(term, &map, px, py, mask, lights);
+    fovRenderPortals(term, &map, px, py, player_fov->portals, lights);
     turnUser(term, &map, player);
     //spriteMove(term, (vec2){0.1f, 0.1f}, 0, 1);
     termDrawRefresh(term);
   }
 
+  lightMapDestroy(lights, &map);
+  arenaDestroy(light_allocator);
+  fovCacheDestroy(player_fov, &map, fov_allocator);
   arenaDestroy(fov_allocator);
+  dungeonGenDestroy(dungeon, arena);
   arenaDestroy(arena);
   termCtxDestroy(term);
   return 0;
@@ -1,6 +1,8 @@
+#include "bench.h"
 
 #include "dungeon.h"
 #include "fov.h"
+#include "light.h"
 #include "map.h"
 #include "bios.h"
 int turnUser(TermCtx term, struct Map* m, struct Mobile* mob);
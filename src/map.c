@@ -78,7 +78,7 @@ size_t spatialHashIndex(struct SpatialHash* hash, uint32_t x, uint32_t y) {
 
 struct HashPosHead* spatialHashGetCell(struct SpatialHash* hash, uint32_t x,
                                        uint32_t y) {
-  return &hash->cells[spatialHashIndex(hash, x, y)];
+  return &FAT_PTR_AT(hash->cells, spatialHashIndex(hash, x, y));
 }
 
 struct HashPos* spatialHashGet(struct SpatialHash* hash, uint32_t x,
@@ -109,7 +109,7 @@ struct HashPosSearch* spatialHashSearch(struct SpatialHash* hash, uint32_t x,
   for (uint32_t i = 0; i < c; i++) {
     uint32_t dx = ((i % width) - r) * hash->cell_len;
     uint32_t dy = ((i / width) - r) * hash->cell_len;
-    search->range[i] = *spatialHashGetCell(hash, x + dx, y + dy);
+    FAT_PTR_AT(search->range, i) = *spatialHashGetCell(hash, x + dx, y + dy);
   }
 
   search->cur_pos = SLIST_FIRST(&search->range[0]);
@@ -126,7 +126,7 @@ struct HashPos* spatialHashSearchNext(struct HashPosSearch* iter) {
   if (!iter->cur_pos) {
     if (iter->range_i == fatPtrC(iter->range) - 1) return NULL;
     iter->range_i++;
-    iter->cur_pos = SLIST_FIRST(&iter->range[iter->range_i]);
+    iter->cur_pos = SLIST_FIRST(&FAT_PTR_AT(iter->range, iter->range_i));
     return spatialHashSearchNext(iter);
   }
 
@@ -183,13 +183,33 @@ struct MapPool mapPoolCreate(size_t bucket_count, size_t cell_len,
 struct Map mapCreate(Allocator allocator) {
   struct Map ret = {0};
   ret.arena = allocator;
-  ret.portals = mapPoolCreate(4, 1, allocator);
+  ret.portals = mapPoolCreate(16, PORTAL_CELL_LEN, allocator);
   ret.chunks = mapPoolCreate(4, 1, allocator);
   ret.mobs = mapPoolCreate(32, 16, allocator);
+  SLIST_INIT_HEAD(&ret.watches);
 
   return ret;
 }
 
+void mapWatchAdd(struct Map* m, struct MapWatch* watch) {
+  SLIST_INSERT_HEAD(&m->watches, watch, entry);
+}
+
+void mapWatchRemove(struct Map* m, struct MapWatch* watch) {
+  SLIST_REMOVE(&m->watches, watch, struct MapWatch, entry);
+}
+
+void mapTouch(struct Map* m, uint32_t x, uint32_t y) {
+  m->revision++;
+  struct MapWatch* watch;
+  SLIST_FOREACH(watch, &m->watches, entry) {
+    // signed differences keep watches near 0 working across the wrap
+    uint32_t dx = abs((int32_t)(x - watch->x));
+    uint32_t dy = abs((int32_t)(y - watch->y));
+    if (dx <= watch->radius && dy <= watch->radius) watch->revision++;
+  }
+}
+
 void* mapPoolMallocFn(struct MapPool* pool, size_t elm_size,
                       size_t hash_entry_offset, int64_t x, int64_t y,
                       Allocator a) {
@@ -210,3 +230,11 @@ void* mapPoolMallocFn(struct MapPool* pool, size_t elm_size,
   return ret;
 }
 
+/* unhooks the entry from the hash and keeps its memory for the next
+ * mapPoolMallocFn of the pool
+ */
+void mapPoolFree(struct MapPool* pool, struct HashPos* pos) {
+  spatialHashRemove(pool->hash, pos);
+  SLIST_INSERT_HEAD(&pool->free_list, pos, entry);
+}
+
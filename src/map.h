@@ -11,6 +11,7 @@
 #define MAP_SCALE 8
 #define CHUNK_LEN 16
 #define CHUNK_AREA CHUNK_LEN* CHUNK_LEN
+#define PORTAL_CELL_LEN CHUNK_LEN
 
 typedef struct SpatialHash SpatialHash;
 struct HashPos {
@@ -28,11 +29,41 @@ struct MapPool {
   SpatialHash* hash;
 };
 
+/*
+ * Map Watches
+ * a square area of interest around (x, y), mapTouch bumps the
+ * revision of every watch whose area contains the changed tile and
+ * the map's own revision, terraPut and portalCreate touch their tile
+ * and anything else that changes what a tile shows must do the same
+ */
+struct MapWatch {
+  SLIST_ENTRY(struct MapWatch) entry;
+  uint32_t x;
+  uint32_t y;
+  uint32_t radius;
+  uint32_t revision;
+};
+SLIST_HEAD(MapWatchHead, struct MapWatch);
+
+/*
+ * Map Generators
+ * fill in a chunk the first time it is needed, the chunk is already
+ * inserted when the generator runs so it can terraPut into it, but
+ * it must not terraPut outside it
+ */
+struct Map;
+typedef void (*MapGenFn)(struct Map*, uint32_t chunk_x, uint32_t chunk_y,
+                         void* ctx);
+
 struct Map {
   Allocator arena;
   struct MapPool chunks;
   struct MapPool portals;
   struct MapPool mobs;
+  struct MapWatchHead watches;
+  uint32_t revision;
+  MapGenFn generate;
+  void* generate_ctx;
 };
 
 struct MapPos {
@@ -100,6 +131,7 @@ struct HashPos* searchAll(struct HashPosSearch* cursor);
 
 void* mapPoolMallocFn(struct MapPool*, size_t, size_t, int64_t, int64_t,
                       Allocator);
+void mapPoolFree(struct MapPool*, struct HashPos*);
 
 #define MAP_SEARCH(map_, entry_, radius_, allocator_)                        \
   (spatialHashSearch((pos_).map->entry_.hash, (pos_).x, (pos_).y, (radius_), \
@@ -109,13 +141,23 @@ void* mapPoolMallocFn(struct MapPool*, size_t, size_t, int64_t, int64_t,
 #define MAP_CAST(parent_type_, hash_pos_) \
   (container_of((hash_pos_), parent_type_, hash_pos_entry))
 
+struct MapPool mapPoolCreate(size_t bucket_count, size_t cell_len, Allocator);
 struct Map mapCreate(Allocator allocator);
+void mapWatchAdd(struct Map*, struct MapWatch*);
+void mapWatchRemove(struct Map*, struct MapWatch*);
+void mapTouch(struct Map*, uint32_t, uint32_t);
 struct MapChunk* mapChunkInsert(struct Map* m, uint32_t, uint32_t);
+void mapGeneratorSet(struct Map*, MapGenFn, void* ctx);
+struct MapChunk* mapChunkGenerate(struct Map*, uint32_t, uint32_t);
+void mapGenerateAround(struct Map*, uint32_t, uint32_t, uint32_t radius);
 
 struct Terra terraGet(struct Map*, uint32_t, uint32_t);
 void terraPut(struct Map*, uint32_t, uint32_t, struct Terra);
+void terraViewGather(struct Map*, uint32_t, uint32_t, Bitmap*);
+void terraExploredGather(struct Map*, uint32_t, uint32_t, Bitmap*);
+void terraExplore(struct Map*, uint32_t, uint32_t, Bitmap*);
 
-struct Portal* portalCreate(struct Map, uint32_t, uint32_t, uint32_t, uint32_t);
+struct Portal* portalCreate(struct Map*, uint32_t, uint32_t, uint32_t, uint32_t);
 struct Portal* portalGet(struct Map m, uint32_t, uint32_t);
 
 #endif  // WORLD_H
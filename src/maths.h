@@ -94,12 +94,29 @@ static inline double frResolve(Fraction fr) {
   return (double)fr.num / (double)fr.den;
 }
 
+/* integer floor and ceiling of a fraction with a positive denominator,
+ * C division truncates toward zero so negative quotients are corrected
+ */
+static inline long long frFloor(Fraction fr) {
+  assert(fr.den > 0);
+  long long q = fr.num / fr.den;
+  return (fr.num % fr.den < 0) ? q - 1 : q;
+}
+
+static inline long long frCeil(Fraction fr) {
+  assert(fr.den > 0);
+  long long q = fr.num / fr.den;
+  return (fr.num % fr.den > 0) ? q + 1 : q;
+}
+
+// floor(n/d + 1/2) == floor((2n + d) / 2d)
 static inline int frRoundTiesUp(Fraction fr) {
-  return floor(frResolve(fr) + 0.5);
+  return frFloor((Fraction){2 * fr.num + fr.den, 2 * fr.den});
 }
 
+// ceil(n/d - 1/2) == ceil((2n - d) / 2d)
 static inline int frRoundTiesDown(Fraction fr) {
-  return ceil(frResolve(fr) - 0.5);
+  return frCeil((Fraction){2 * fr.num - fr.den, 2 * fr.den});
 }
 
 static inline bool frCompare(Fraction small, Fraction large) {
@@ -0,0 +1,273 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fov.h"
+#include "maths.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define RAYCAST_X86 1
+#include <immintrin.h>
+#else
+#define RAYCAST_X86 0
+#endif
+
+/*
+ * Ray tables
+ * every target in the (2r + 1) square around the viewer has two rays,
+ * the lines to it with ties in the minor axis rounded down and up.
+ * A ray is a run of words laid out exactly like the opacity grid so a
+ * target is visible when either ray ANDed with the grid is all zero
+ */
+struct FovRay {
+  uint32_t first;
+  uint32_t count;
+  uint32_t offset;
+};
+
+struct FovRayTable {
+  Allocator arena;
+  uint32_t radius;
+  uint32_t stride;
+  struct FovRay* rays;
+  uint64_t* words;
+};
+
+typedef bool (*RayClearFn)(const uint64_t*, const uint64_t*, size_t);
+
+static pthread_mutex_t ray_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct FovRayTable* ray_tables[FOV_RADIUS_MAX + 1];
+
+/* tiles strictly between the viewer and (dx, dy), returns the count */
+static int rayTrace(int dx, int dy, bool round_up, int* out_x, int* out_y) {
+  int major = iMax(abs(dx), abs(dy));
+  int minor = iMin(abs(dx), abs(dy));
+  bool x_major = abs(dx) >= abs(dy);
+  int count = 0;
+
+  for (int i = 1; i < major; i++) {
+    // i * minor / major to the nearest tile, ties one way or the other
+    int step = (2 * i * minor + major - !round_up) / (2 * major);
+    out_x[count] = (dx < 0 ? -1 : 1) * (x_major ? i : step);
+    out_y[count] = (dy < 0 ? -1 : 1) * (x_major ? step : i);
+    count++;
+  }
+  return count;
+}
+
+/* the run of words covering n traced tiles, written into words when
+ * it isn't NULL, returns the word count
+ */
+static uint32_t rayPack(uint32_t radius, uint32_t stride, int n, int* xs,
+                        int* ys, uint32_t* first, uint64_t* words) {
+  if (!n) {
+    *first = 0;
+    return 0;
+  }
+
+  size_t lo = SIZE_MAX, hi = 0;
+  for (int i = 0; i < n; i++) {
+    size_t bit = (size_t)(ys[i] + radius) * stride + (xs[i] + radius);
+    lo = bit < lo ? bit : lo;
+    hi = bit > hi ? bit : hi;
+  }
+  *first = lo / BITMAP_WORD_BITS;
+
+  for (int i = 0; words && i < n; i++) {
+    size_t bit = (size_t)(ys[i] + radius) * stride + (xs[i] + radius) -
+                 (size_t)*first * BITMAP_WORD_BITS;
+    words[bit / BITMAP_WORD_BITS] |= 1ULL << (bit % BITMAP_WORD_BITS);
+  }
+  return hi / BITMAP_WORD_BITS - *first + 1;
+}
+
+/* two passes over every target, the first sizes the word pool so the
+ * table is a single exact allocation, targets whose line has no ties
+ * share one run of words between both rays
+ */
+static struct FovRayTable* rayTableBuild(uint32_t radius) {
+  int side = radius * 2 + 1;
+  int targets = side * side;
+  Allocator scratch = threadArenaAllocator();
+  Bitmap* shape = bitmapCreate(side, side, scratch);
+  uint32_t stride = bitmapStride(shape);
+  bitmapDestroy(shape, scratch);
+
+  int* trace = scratch->mallocFn(scratch, sizeof(int) * side * 4);
+  int* down_x = trace;
+  int* down_y = trace + side;
+  int* up_x = trace + side * 2;
+  int* up_y = trace + side * 3;
+
+  struct FovRayTable* table = NULL;
+  size_t word_total = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass) {
+      size_t size = sizeof(struct FovRayTable) +
+                    sizeof(struct FovRay) * targets * 2 +
+                    sizeof(uint64_t) * word_total + 4 * KB;
+      Allocator arena = arenaCreate(size, NULL);
+      table = arena->mallocFn(arena, sizeof(*table));
+      table->arena = arena;
+      table->radius = radius;
+      table->stride = stride;
+      table->rays =
+          arena->mallocFn(arena, sizeof(struct FovRay) * targets * 2);
+      table->words = arena->mallocFn(arena, sizeof(uint64_t) * word_total);
+      memset(table->words, 0, sizeof(uint64_t) * word_total);
+    }
+
+    size_t offset = 0;
+    for (int t = 0; t < targets; t++) {
+      int dx = t % side - (int)radius;
+      int dy = t / side - (int)radius;
+      int n = rayTrace(dx, dy, false, down_x, down_y);
+      rayTrace(dx, dy, true, up_x, up_y);
+      bool tied = memcmp(down_x, up_x, sizeof(int) * n) ||
+                  memcmp(down_y, up_y, sizeof(int) * n);
+
+      struct FovRay down = {.offset = offset};
+      down.count = rayPack(radius, stride, n, down_x, down_y, &down.first,
+                           pass ? &table->words[offset] : NULL);
+      offset += down.count;
+
+      struct FovRay up = down;
+      if (tied) {
+        up.offset = offset;
+        up.count = rayPack(radius, stride, n, up_x, up_y, &up.first,
+                           pass ? &table->words[offset] : NULL);
+        offset += up.count;
+      }
+
+      if (pass) {
+        table->rays[t * 2] = down;
+        table->rays[t * 2 + 1] = up;
+      }
+    }
+    word_total = offset;
+  }
+
+  scratch->freeFn(scratch, trace);
+  return table;
+}
+
+/* tables are built once per radius on first use and kept for the life
+ * of the process
+ */
+static struct FovRayTable* rayTableGet(uint32_t radius) {
+  pthread_mutex_lock(&ray_table_lock);
+  if (!ray_tables[radius]) ray_tables[radius] = rayTableBuild(radius);
+  struct FovRayTable* table = ray_tables[radius];
+  pthread_mutex_unlock(&ray_table_lock);
+  return table;
+}
+
+static bool rayClearScalar(const uint64_t* ray, const uint64_t* opaque,
+                           size_t n) {
+  uint64_t hit = 0;
+  for (size_t i = 0; i < n; i++) hit |= ray[i] & opaque[i];
+  return !hit;
+}
+
+#if RAYCAST_X86
+__attribute__((target("sse2"))) static bool rayClearSse2(
+    const uint64_t* ray, const uint64_t* opaque, size_t n) {
+  __m128i hit = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i r = _mm_loadu_si128((const __m128i*)(ray + i));
+    __m128i o = _mm_loadu_si128((const __m128i*)(opaque + i));
+    hit = _mm_or_si128(hit, _mm_and_si128(r, o));
+  }
+  uint64_t rest = 0;
+  for (; i < n; i++) rest |= ray[i] & opaque[i];
+  hit = _mm_cmpeq_epi8(hit, _mm_setzero_si128());
+  return _mm_movemask_epi8(hit) == 0xFFFF && !rest;
+}
+
+__attribute__((target("avx2"))) static bool rayClearAvx2(
+    const uint64_t* ray, const uint64_t* opaque, size_t n) {
+  __m256i hit = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i r = _mm256_loadu_si256((const __m256i*)(ray + i));
+    __m256i o = _mm256_loadu_si256((const __m256i*)(opaque + i));
+    hit = _mm256_or_si256(hit, _mm256_and_si256(r, o));
+  }
+  uint64_t rest = 0;
+  for (; i < n; i++) rest |= ray[i] & opaque[i];
+  return _mm256_testz_si256(hit, hit) && !rest;
+}
+#endif
+
+/* the requested path or the widest one below it the cpu can run */
+static RayClearFn rayClearSelect(enum FovAlgorithm algorithm) {
+#if RAYCAST_X86
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool sse2 = __builtin_cpu_supports("sse2");
+  switch (algorithm) {
+    case FOV_RAYCAST:
+    case FOV_RAYCAST_AVX2:
+      if (avx2) return rayClearAvx2;
+      // fall through
+    case FOV_RAYCAST_SSE2:
+      if (sse2) return rayClearSse2;
+      // fall through
+    default:
+      return rayClearScalar;
+  }
+#else
+  (void)algorithm;
+  return rayClearScalar;
+#endif
+}
+
+bool fovAlgorithmSupported(enum FovAlgorithm algorithm) {
+#if RAYCAST_X86
+  if (algorithm == FOV_RAYCAST_AVX2) return __builtin_cpu_supports("avx2");
+  if (algorithm == FOV_RAYCAST_SSE2) return __builtin_cpu_supports("sse2");
+  return true;
+#else
+  return algorithm != FOV_RAYCAST_AVX2 && algorithm != FOV_RAYCAST_SSE2;
+#endif
+}
+
+/* fills out_mask like fovCompute but by testing every target's rays
+ * against a grid gathered exactly over the radius
+ */
+static void fovRaycast(struct Map* m, uint32_t x, uint32_t y, uint32_t radius,
+                       Bitmap* out_mask, RayClearFn rayClear) {
+  struct FovRayTable* table = rayTableGet(radius);
+  int side = radius * 2 + 1;
+  Allocator scratch = threadArenaAllocator();
+  struct FovGrid grid =
+      fovGridGather(m, x - radius, y - radius, side, side, scratch);
+  const uint64_t* opaque = bitmapRow(grid.opaque, 0);
+
+  bitmapFill(out_mask, 0);
+  int32_t mx0 = bitmapWidth(out_mask) / 2 - radius;
+  int32_t my0 = bitmapHeight(out_mask) / 2 - radius;
+
+  for (int t = 0; t < side * side; t++) {
+    struct FovRay* down = &table->rays[t * 2];
+    struct FovRay* up = &table->rays[t * 2 + 1];
+    if (rayClear(&table->words[down->offset], opaque + down->first,
+                 down->count) ||
+        (up->offset != down->offset &&
+         rayClear(&table->words[up->offset], opaque + up->first, up->count)))
+      bitmapPutPx(out_mask, mx0 + t % side, my0 + t / side, 1);
+  }
+
+  fovGridDestroy(grid, scratch);
+}
+
+void fovComputeWith(enum FovAlgorithm algorithm, struct Map* m, uint32_t x,
+                    uint32_t y, uint32_t radius, Bitmap* out_mask) {
+  radius = iMin(radius, FOV_RADIUS_MAX);
+  if (algorithm == FOV_SHADOWCAST) {
+    fovCompute(m, x, y, radius, out_mask);
+    return;
+  }
+  fovRaycast(m, x, y, radius, out_mask, rayClearSelect(algorithm));
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "map.h"
+#include "maths.h"
 
 struct MapChunk {
   HASH_POS_ENTRY;
@@ -10,6 +11,7 @@ struct MapChunk {
   struct UnicodeTile* tiles;
   Bitmap* blocks_view_bmp;
   Bitmap* blocks_move_bmp;
+  Bitmap* explored_bmp;
 };
 
 struct UnicodeTile NULL_TILE = {
@@ -39,6 +41,7 @@ struct MapChunk* mapChunkInsert(struct Map* m, uint32_t x, uint32_t y) {
 
   ret->blocks_view_bmp = bitmapCreate(CHUNK_LEN, CHUNK_LEN, m->arena);
   ret->blocks_move_bmp = bitmapCreate(CHUNK_LEN, CHUNK_LEN, m->arena);
+  ret->explored_bmp = bitmapCreate(CHUNK_LEN, CHUNK_LEN, m->arena);
   ret->tiles = fatPtrCreate(CHUNK_AREA, sizeof(struct Terra), m->arena);
 
   struct UnicodeTile air = {
@@ -54,6 +57,41 @@ struct MapChunk* mapChunkInsert(struct Map* m, uint32_t x, uint32_t y) {
 
 void mapDestroy(struct Map m) { spatialHashDestroy(m.chunks.hash, m.arena); }
 
+void mapGeneratorSet(struct Map* m, MapGenFn generate, void* ctx) {
+  m->generate = generate;
+  m->generate_ctx = ctx;
+}
+
+/* the chunk at chunk coordinates (x, y), inserting it and running the
+ * map's generator over it if it doesn't exist yet
+ */
+struct MapChunk* mapChunkGenerate(struct Map* m, uint32_t x, uint32_t y) {
+  struct MapChunk* chunk = SHASH_GET(m->chunks.hash, struct MapChunk, x, y);
+  if (chunk) return chunk;
+
+  if (!(chunk = mapChunkInsert(m, x, y))) return NULL;
+  if (m->generate) m->generate(m, x, y, m->generate_ctx);
+  return chunk;
+}
+
+/* generates every missing chunk overlapping the square of radius
+ * around (x, y), chunk coordinates wrap like world ones
+ */
+void mapGenerateAround(struct Map* m, uint32_t x, uint32_t y,
+                       uint32_t radius) {
+  uint32_t wrap = UINT32_MAX / CHUNK_LEN;
+  uint32_t cx0 = (x - radius) / CHUNK_LEN;
+  uint32_t cy0 = (y - radius) / CHUNK_LEN;
+  uint32_t w = (((x + radius) / CHUNK_LEN - cx0) & wrap) + 1;
+  uint32_t h = (((y + radius) / CHUNK_LEN - cy0) & wrap) + 1;
+
+  for (uint32_t j = 0; j < h; j++) {
+    for (uint32_t i = 0; i < w; i++) {
+      if (!mapChunkGenerate(m, (cx0 + i) & wrap, (cy0 + j) & wrap)) abort();
+    }
+  }
+}
+
 /*
 struct TerraPos terrainLocalisePos(struct Map m, uint32_t x, uint32_t y )
 {
@@ -83,6 +121,76 @@ struct Terra terraGet(struct Map* m, uint32_t x_in, uint32_t y_in) {
   };
 }
 
+/* copies the chunk bitmap at bmp_offset within each MapChunk over the
+ * world rectangle starting at (x0, y0) into dst, looking each chunk up
+ * once and copying its rows a word at a time, missing chunks read as 0
+ */
+static void terraGather(struct Map* m, uint32_t x0, uint32_t y0, Bitmap* dst,
+                        size_t bmp_offset) {
+  uint32_t w = bitmapWidth(dst);
+  uint32_t h = bitmapHeight(dst);
+  bitmapFill(dst, 0);
+
+  uint32_t span_h;
+  for (uint32_t r = 0; r < h; r += span_h) {
+    uint32_t y = y0 + r;
+    span_h = iMin(CHUNK_LEN - (y % CHUNK_LEN), h - r);
+
+    uint32_t span_w;
+    for (uint32_t c = 0; c < w; c += span_w) {
+      uint32_t x = x0 + c;
+      span_w = iMin(CHUNK_LEN - (x % CHUNK_LEN), w - c);
+
+      struct MapChunk* chunk = SHASH_GET(m->chunks.hash, struct MapChunk,
+                                         x / CHUNK_LEN, y / CHUNK_LEN);
+      if (!chunk) continue;
+      Bitmap* src = *(Bitmap**)((char*)chunk + bmp_offset);
+      bitmapCopyRect(dst, c, r, src, x % CHUNK_LEN, y % CHUNK_LEN, span_w,
+                     span_h);
+    }
+  }
+}
+
+/* blocks_view over a world rectangle, missing chunks read as open */
+void terraViewGather(struct Map* m, uint32_t x0, uint32_t y0, Bitmap* dst) {
+  terraGather(m, x0, y0, dst, offsetof(struct MapChunk, blocks_view_bmp));
+}
+
+/* explored tiles over a world rectangle, missing chunks read as
+ * unexplored
+ */
+void terraExploredGather(struct Map* m, uint32_t x0, uint32_t y0,
+                         Bitmap* dst) {
+  terraGather(m, x0, y0, dst, offsetof(struct MapChunk, explored_bmp));
+}
+
+/* ORs the world rectangle of src starting at (x0, y0) into the explored
+ * bitmaps of the chunks it covers, tiles in missing chunks have nothing
+ * to remember and are dropped
+ */
+void terraExplore(struct Map* m, uint32_t x0, uint32_t y0, Bitmap* src) {
+  uint32_t w = bitmapWidth(src);
+  uint32_t h = bitmapHeight(src);
+
+  uint32_t span_h;
+  for (uint32_t r = 0; r < h; r += span_h) {
+    uint32_t y = y0 + r;
+    span_h = iMin(CHUNK_LEN - (y % CHUNK_LEN), h - r);
+
+    uint32_t span_w;
+    for (uint32_t c = 0; c < w; c += span_w) {
+      uint32_t x = x0 + c;
+      span_w = iMin(CHUNK_LEN - (x % CHUNK_LEN), w - c);
+
+      struct MapChunk* chunk = SHASH_GET(m->chunks.hash, struct MapChunk,
+                                         x / CHUNK_LEN, y / CHUNK_LEN);
+      if (!chunk) continue;
+      bitmapOrRect(chunk->explored_bmp, x % CHUNK_LEN, y % CHUNK_LEN, src, c,
+                   r, span_w, span_h);
+    }
+  }
+}
+
 void terraPut(struct Map* m, uint32_t x_in, uint32_t y_in, struct Terra put) {
   // printf("terrput %d %d\n", x_in, y_in);
 
@@ -91,7 +199,7 @@ void terraPut(struct Map* m, uint32_t x_in, uint32_t y_in, struct Terra put) {
                                      x_in / CHUNK_LEN, y_in / CHUNK_LEN);
   if (!chunk) {
     // printf("creating chunk...\n");
-    if (!(chunk = mapChunkInsert(m, x_in / CHUNK_LEN, y_in / CHUNK_LEN)))
+    if (!(chunk = mapChunkGenerate(m, x_in / CHUNK_LEN, y_in / CHUNK_LEN)))
       abort();
   }
 
@@ -102,6 +210,8 @@ void terraPut(struct Map* m, uint32_t x_in, uint32_t y_in, struct Terra put) {
   chunk->tiles[offset] = put.tile;
   bitmapPutPx(chunk->blocks_view_bmp, x, y, put.blocks_view);
   bitmapPutPx(chunk->blocks_move_bmp, x, y, put.blocks_move);
+
+  mapTouch(m, x_in, y_in);
 }
 
 /*
@@ -137,17 +247,18 @@ void TerraTilePut(struct TerraPos p, struct UnicodeTile t){
     p.chunk->tiles[offset] = t;
 }
 */
-struct Portal* portalCreate(struct Map m,
+struct Portal* portalCreate(struct Map* m,
                             uint32_t src_x, uint32_t src_y,
                             uint32_t dst_x, uint32_t dst_y)
 {
-    if(spatialHashGet(m.portals.hash, src_x, src_y)) return NULL;
+    if(spatialHashGet(m->portals.hash, src_x, src_y)) return NULL;
 
     struct Portal* port =
-        MAP_POOL_MALLOC(&m, portals, struct Portal, src_x, src_y);
+        MAP_POOL_MALLOC(m, portals, struct Portal, src_x, src_y);
 
     port->dst_x = dst_x;
     port->dst_y = dst_y;
+    mapTouch(m, src_x, src_y);
     return port;
 }
 
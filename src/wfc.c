@@ -7,18 +7,18 @@
 
 #include "wfc.h"
 
+#include <assert.h>
 #include <ctype.h>
-#include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
-#include <time.h>
 
 #include "../extern/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../extern/stb_image_write.h"
 
-#define WFC_MAX_PROP_CNT 1000
-
 struct wfc;
 
 struct wfc *wfc_overlapping(
@@ -40,6 +40,8 @@ void wfc_destroy(struct wfc *wfc);
 
 enum wfc__direction { WFC_UP, WFC_DOWN, WFC_LEFT, WFC_RIGHT };
 int directions[4] = {WFC_UP, WFC_DOWN, WFC_LEFT, WFC_RIGHT};
+static const enum wfc__direction wfc__opposite[4] = {WFC_DOWN, WFC_UP,
+                                                     WFC_RIGHT, WFC_LEFT};
 enum wfc__method { WFC_METHOD_OVERLAPPING, WFC_METHOD_TILED };
 
 // Rules are stored in tiles
@@ -53,8 +55,8 @@ struct wfc__tile {
 };
 
 struct wfc__cell {
-  int *tiles;  // Possible tiles in the cell (initially all)
-  int tile_cnt;
+  int tile_cnt;  // Number of possible tiles, the tiles themselves are
+                 // the cell's bitset in wfc->wave
 
   int sum_freqs;  // Sum of tile frequencies used to calculate
                   // entropy and randomly pick a tile when
@@ -62,18 +64,41 @@ struct wfc__cell {
 
   double entropy;  // Shannon entropy. Cell with the smallest entropy
                    // is picked to be collapsed next.
+
+  double noise;  // Small per-cell noise added to the entropy to break
+                 // ties, picked once per run
 };
 
+// Pushes the tiles banned in the source cell, and not yet propagated in the
+// direction, to the destination cell
 struct wfc__prop {
   int src_cell_idx;
   int dst_cell_idx;
   enum wfc__direction direction;
 };
 
+// A tile ban with the cell's state just before it, enough to undo it
+struct wfc__journal_entry {
+  int cell_idx;
+  int tile_idx;
+  int sum_freqs;
+  double entropy;
+};
+
+// A cell collapsed by a random pick
+struct wfc__decision {
+  int cell_idx;
+  int tile_idx;
+  int journal_idx;  // Journal length before the decision
+  int collapsed_cell_cnt;
+};
+
 // One structure for overlapping and tiled models
 struct wfc {
   enum wfc__method method;  // overlapping or tiled?
   unsigned int seed;
+  uint64_t rng;  // Random number state, per instance so instances can run
+                 // on different threads
 
   /* tiles */
 
@@ -86,6 +111,7 @@ struct wfc {
   int rotate_tiles;
   struct wfc__tile *tiles;  // All available tiles
   int tile_cnt;
+  int tile_words;  // 64-bit words in one tile bitset
   int sum_freqs;
 
   /* output */
@@ -94,26 +120,150 @@ struct wfc {
   int output_height;        // Output height in pixels
   struct wfc__cell *cells;  // One per output pixel
   int cell_cnt;             // width * height
+  uint64_t *wave;           // Possible tiles of each cell as a bitset of
+                            // tile_words words, bit t is tile t
+
+  // Support counts (AC-4). supports[(cell_idx*tile_cnt + tile_idx)*4 + d]
+  // is the number of tiles still possible in the neighbour the direction
+  // d points away from that enable tile_idx in cell_idx. The tile is
+  // banned once any of its counts drops to zero.
+  int *supports;
+  int *init_supports;  // Counts of a cell with all tiles possible
+  uint64_t *removed;   // Tiles banned in each cell but not yet propagated
+                       // in each direction, one bitset per (cell, d)
 
   /* in-use */
 
-  struct wfc__prop *props;  // Propagation updates
+  // Propagation updates, a ring buffer of cell_cnt * 4 props starting at
+  // prop_idx. A (cell, direction) prop is queued at most once at a time,
+  // tracked by its bit in prop_pending, so the ring can't overflow.
+  struct wfc__prop *props;
   int prop_cnt;
-  int prop_idx;  // Current index into props, used to scan
-                 // props forward to check whether a
-                 // a candidate prop is already there
+  int prop_idx;
+  uint64_t *prop_pending;
   int collapsed_cell_cnt;
 
-  // These are the rules. A matrix lookup of allowed tile pairs in each
-  // direction. allowed_tiles[d][src_idx*tile_cnt + dst_idx] is 1 or 0
-  // depending on whether dst_idx tile can be placed next to the src_idx
-  // tile in the direction d.
+  // Min-heap of the cells not yet collapsed keyed on entropy + noise, so
+  // the next cell is found in O(log N). heap_pos[cell_idx] is the cell's
+  // index in heap or -1. heap_cnt of -1 means the heap isn't built yet.
+  int *heap;
+  int *heap_pos;
+  int heap_cnt;
+
+  /* backtracking */
+
+  int backtrack_depth;  // Decisions that can be undone, 0 disables
+  int max_restarts;     // Full restarts before wfc_run gives up
+  struct wfc__decision *decisions;  // The last backtrack_depth decisions
+  int decision_cnt;
+  struct wfc__journal_entry *journal;  // Bans made since decisions[0],
+                                       // entries below journal_base
+                                       // belong to dropped decisions
+  int journal_base;
+  int journal_cnt;
+  int journal_cap;
+  int attempt_decision_cnt;  // Work done since the last (re)start
+  long attempt_ban_cnt;
+  int attempt_backtrack_cnt;
+  int restart_cnt;  // Restarts since wfc_init or the state was copied,
+                    // stats only reports them
+  struct wfc_stats stats;
+
+  /* constraints */
+
+  int component_cnt;           // Components of a tile pixel
+  unsigned char *constraints;  // Pixel each cell is pinned to by
+                               // wfc_constrain, component_cnt per cell
+  uint64_t *constrained;       // Bit per cell with a constraint
+  int *constraint_tiles;       // Tile a constrained cell is pinned to,
+                               // -1 if only its pixel is
+
+  /* threads */
+
+  struct wfc *model;    // Instance whose tiles and rules this one shares,
+                        // NULL if it owns them
+  struct wfc **clones;  // Same sized instances running the other
+  int clone_cnt;        // wfc_run_parallel attempts, kept between runs
+  atomic_int *winner;   // Lowest attempt that succeeded, wfc_run gives up
+  int clone_idx;        // once it's below this instance's attempt
+
+  // These are the rules. compat[d] holds one tile bitset per source
+  // tile, compat[d][src_idx*tile_words ...] has the bit of every
+  // dst_idx tile that can be placed next to the src_idx tile in the
+  // direction d.
   //
   // In the overlapping method tiles are allowed next to each other if
   // their content overlaps, excluding the edges.
-  int *allowed_tiles[4];
+  uint64_t *compat[4];
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Tile bitsets
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int wfc__tile_words(int tile_cnt) { return (tile_cnt + 63) / 64; }
+
+static inline uint64_t *wfc__cell_tiles(struct wfc *wfc, int cell_idx) {
+  return &wfc->wave[(size_t)cell_idx * wfc->tile_words];
+}
+
+static inline void wfc__tiles_set(uint64_t *tiles, int tile_idx) {
+  tiles[tile_idx / 64] |= 1ULL << (tile_idx % 64);
+}
+
+static inline int wfc__tiles_get(uint64_t *tiles, int tile_idx) {
+  return (tiles[tile_idx / 64] >> (tile_idx % 64)) & 1;
+}
+
+static inline uint64_t *wfc__cell_removed(struct wfc *wfc, int cell_idx,
+                                          enum wfc__direction d) {
+  return &wfc->removed[((size_t)cell_idx * 4 + d) * wfc->tile_words];
+}
+
+// Return the first tile at or after tile_idx in the set, -1 if none
+static inline int wfc__tiles_next(uint64_t *tiles, int words, int tile_idx) {
+  int w = tile_idx / 64;
+  if (w >= words) return -1;
+
+  uint64_t bits = tiles[w] & (~0ULL << (tile_idx % 64));
+  while (!bits) {
+    if (++w == words) return -1;
+    bits = tiles[w];
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+#define WFC__FOREACH_TILE(tile_idx_, tiles_, words_)                   \
+  for (int tile_idx_ = wfc__tiles_next((tiles_), (words_), 0);         \
+       tile_idx_ != -1;                                                \
+       tile_idx_ = wfc__tiles_next((tiles_), (words_), tile_idx_ + 1))
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Random numbers
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// splitmix64
+static inline uint64_t wfc__rand(struct wfc *wfc) {
+  uint64_t z = (wfc->rng += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Return a number in [0, n)
+static inline int wfc__rand_below(struct wfc *wfc, int n) {
+  return (int)(wfc__rand(wfc) % (uint64_t)n);
+}
+
+// Return a number in [0, 1)
+static inline double wfc__rand_01(struct wfc *wfc) {
+  return (wfc__rand(wfc) >> 11) * 0x1.0p-53;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Img helpers
@@ -244,59 +394,49 @@ static struct wfc_image *wfc__img_expand(struct wfc_image *image, int xexp,
   return exp_image;
 }
 
-// Return 1 if the two images overlap perfectly except the edges in the given
-// direction, 0 otherwise.
-static int wfc__img_cmpoverlap(struct wfc_image *a, struct wfc_image *b,
-                               enum wfc__direction direction) {
-  int a_offx, a_offy, b_offx, b_offy, width, height;
+// The part of a tile that overlaps its neighbour in the given direction,
+// the tile less its row or column on the far side. Two tiles can be
+// neighbours when the first one's region in the direction matches the
+// second one's region in the opposite direction.
+struct wfc__region {
+  int x, y, width, height;
+};
 
+static struct wfc__region wfc__img_region(struct wfc_image *image,
+                                          enum wfc__direction direction) {
+  int width = image->width, height = image->height;
   switch (direction) {
     case WFC_UP:
-      a_offx = 0;
-      a_offy = 0;
-      b_offx = 0;
-      b_offy = 1;
-      width = a->width;
-      height = a->height - 1;
-      break;
+      return (struct wfc__region){0, 0, width, height - 1};
     case WFC_DOWN:
-      a_offx = 0;
-      a_offy = 1;
-      b_offx = 0;
-      b_offy = 0;
-      width = a->width;
-      height = a->height - 1;
-      break;
+      return (struct wfc__region){0, 1, width, height - 1};
     case WFC_LEFT:
-      a_offx = 0;
-      a_offy = 0;
-      b_offx = 1;
-      b_offy = 0;
-      width = a->width - 1;
-      height = a->height;
-      break;
+      return (struct wfc__region){0, 0, width - 1, height};
     case WFC_RIGHT:
-      a_offx = 1;
-      a_offy = 0;
-      b_offx = 0;
-      b_offy = 0;
-      width = a->width - 1;
-      height = a->height;
-      break;
-    default:
-      printf("wfc error: wrong direction (%d)\n", direction);
-      return 0;
-  };
+      return (struct wfc__region){1, 0, width - 1, height};
+  }
+  return (struct wfc__region){0, 0, 0, 0};
+}
 
-  for (int y = 0; y < height; y++) {
-    int a_y = a_offy + y;
-    int b_y = b_offy + y;
+static unsigned char *wfc__img_region_row(struct wfc_image *image,
+                                          struct wfc__region region, int y) {
+  return &image->data[((region.y + y) * image->width + region.x) *
+                      image->component_cnt];
+}
+
+// Return 1 if the two regions have the same pixels, 0 otherwise
+static int wfc__img_cmpregion(struct wfc_image *a, enum wfc__direction a_dir,
+                              struct wfc_image *b,
+                              enum wfc__direction b_dir) {
+  struct wfc__region a_region = wfc__img_region(a, a_dir);
+  struct wfc__region b_region = wfc__img_region(b, b_dir);
+  if (a_region.width != b_region.width || a_region.height != b_region.height)
+    return 0;
 
-    if (memcmp(&(a->data[(y + a_offy) * a->width * a->component_cnt +
-                         a_offx * a->component_cnt]),
-               &(b->data[(y + b_offy) * a->width * a->component_cnt +
-                         b_offx * a->component_cnt]),
-               width * a->component_cnt)) {
+  for (int y = 0; y < a_region.height; y++) {
+    if (memcmp(wfc__img_region_row(a, a_region, y),
+               wfc__img_region_row(b, b_region, y),
+               a_region.width * a->component_cnt)) {
       return 0;
     }
   }
@@ -426,7 +566,8 @@ static int *wfc_cells(struct wfc *wfc) {
   int *cells = malloc(sizeof(*cells) * wfc->cell_cnt);
   if (cells == NULL) return NULL;
 
-  for (int i = 0; i < wfc->cell_cnt; i++) cells[i] = wfc->cells[i].tiles[0];
+  for (int i = 0; i < wfc->cell_cnt; i++)
+    cells[i] = wfc__tiles_next(wfc__cell_tiles(wfc, i), wfc->tile_words, 0);
 
   return cells;
 }
@@ -441,11 +582,13 @@ struct wfc_image *wfc_output_image(struct wfc *wfc) {
 
   for (int y = 0; y < wfc->output_height; y++) {
     for (int x = 0; x < wfc->output_width; x++) {
-      struct wfc__cell *cell = &(wfc->cells[y * wfc->output_width + x]);
+      int cell_idx = y * wfc->output_width + x;
+      struct wfc__cell *cell = &(wfc->cells[cell_idx]);
 
       double components[4] = {0, 0, 0, 0};
-      for (int i = 0; i < cell->tile_cnt; i++) {
-        struct wfc__tile *tile = &(wfc->tiles[cell->tiles[i]]);
+      WFC__FOREACH_TILE(tile_idx, wfc__cell_tiles(wfc, cell_idx),
+                        wfc->tile_words) {
+        struct wfc__tile *tile = &(wfc->tiles[tile_idx]);
         for (int j = 0; j < wfc->image->component_cnt; j++) {
           components[j] += tile->image->data[j];
         }
@@ -583,79 +726,205 @@ CLEANUP:
   return 0;
 }
 
-// Return unique tiles with frequencies
+static uint64_t wfc__fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static uint64_t wfc__hash_mix(uint64_t key) {
+  key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+  return key ^ (key >> 31);
+}
+
+static uint32_t wfc__pixel(const unsigned char *pixel, int component_cnt) {
+  uint32_t value = 0;
+  for (int i = 0; i < component_cnt; i++) value = value << 8 | pixel[i];
+  return value;
+}
+
+// Palette of up to 256 colours, an open addressing table from a pixel's
+// components to its index
+struct wfc__palette {
+  uint32_t colours[512];
+  int indices[512];  // -1 for a free slot
+  int colour_cnt;
+  uint32_t last_colour;
+  int last_index;
+};
+
+// Return the colour's index, adding it if there's room, -1 if there isn't
+static int wfc__palette_index(struct wfc__palette *palette, uint32_t colour) {
+  // Neighbouring pixels are mostly the same colour
+  if (palette->colour_cnt && colour == palette->last_colour)
+    return palette->last_index;
+
+  int slot = wfc__hash_mix(colour) & 511;
+  while (palette->indices[slot] != -1 && palette->colours[slot] != colour)
+    slot = (slot + 1) & 511;
+
+  if (palette->indices[slot] == -1) {
+    if (palette->colour_cnt == 256) return -1;
+    palette->colours[slot] = colour;
+    palette->indices[slot] = palette->colour_cnt++;
+  }
+  palette->last_colour = colour;
+  palette->last_index = palette->indices[slot];
+  return palette->last_index;
+}
+
+// Fills in a 64-bit key per tile. When the input has few enough colours
+// for a tile's palette indices to fit in 64 bits the key is the tile
+// itself packed, otherwise it's a hash of the pixels.
+//
+// Return 1 if the keys are packed tiles, 0 if they're hashes
+static int wfc__tile_keys(struct wfc__tile *tiles, int tile_cnt,
+                          uint64_t *keys) {
+  struct wfc_image *image = tiles[0].image;
+  int pixel_cnt = image->width * image->height;
+  int component_cnt = image->component_cnt;
+
+  struct wfc__palette palette;
+  memset(palette.indices, -1, sizeof(palette.indices));
+  palette.colour_cnt = 0;
+
+  int bits = 0;
+  for (int i = 0; bits >= 0 && i < tile_cnt * pixel_cnt; i++) {
+    unsigned char *pixel = &tiles[i / pixel_cnt]
+                                .image->data[(i % pixel_cnt) * component_cnt];
+    if (wfc__palette_index(&palette, wfc__pixel(pixel, component_cnt)) < 0)
+      bits = -1;
+  }
+  while (bits >= 0 && (1 << bits) < palette.colour_cnt) bits++;
+
+  if (bits < 0 || pixel_cnt * bits > 64) {
+    for (int i = 0; i < tile_cnt; i++) {
+      keys[i] = wfc__fnv1a(0xCBF29CE484222325ULL, tiles[i].image->data,
+                           (size_t)pixel_cnt * component_cnt);
+    }
+    return 0;
+  }
+
+  for (int i = 0; i < tile_cnt; i++) {
+    uint64_t key = 0;
+    for (int j = 0; j < pixel_cnt; j++) {
+      uint32_t colour =
+          wfc__pixel(&tiles[i].image->data[j * component_cnt], component_cnt);
+      key = key << bits | wfc__palette_index(&palette, colour);
+    }
+    keys[i] = key;
+  }
+  return 1;
+}
+
+// Return unique tiles with frequencies, in the order they first appear.
+// Tiles are found by their keys in a hash table so this is linear in the
+// tile count.
+//
 // Return 0 on error, non-0 on success
 static int wfc__remove_duplicate_tiles(struct wfc__tile **tiles,
                                        int *tile_cnt) {
-  int unique_cnt = 1;
-  for (int j = 1; j < *tile_cnt; j++) {
-    int unique = 1;
-    for (int k = 0; k < unique_cnt; k++) {
-      if (wfc__img_cmp((*tiles)[j].image, (*tiles)[k].image)) {
-        unique = 0;
-        (*tiles)[k].freq++;
-        break;
-      }
+  int slot_cnt = 1;
+  while (slot_cnt < *tile_cnt * 2) slot_cnt *= 2;
+
+  uint64_t *keys = malloc(sizeof(*keys) * *tile_cnt);
+  int *slots = malloc(sizeof(*slots) * slot_cnt);
+  if (keys == NULL || slots == NULL) goto CLEANUP;
+  memset(slots, -1, sizeof(*slots) * slot_cnt);
+
+  int packed = wfc__tile_keys(*tiles, *tile_cnt, keys);
+
+  int unique_cnt = 0;
+  for (int j = 0; j < *tile_cnt; j++) {
+    int slot = wfc__hash_mix(keys[j]) & (slot_cnt - 1);
+    int k;
+    while ((k = slots[slot]) != -1 &&
+           (keys[k] != keys[j] ||
+            (!packed && !wfc__img_cmp((*tiles)[j].image, (*tiles)[k].image))))
+      slot = (slot + 1) & (slot_cnt - 1);
+
+    if (k != -1) {
+      (*tiles)[k].freq++;
+      continue;
     }
 
-    if (unique) {
-      if (unique_cnt != j) {
-        struct wfc__tile tmp = (*tiles)[unique_cnt];
-        (*tiles)[unique_cnt] = (*tiles)[j];
-        (*tiles)[j] = tmp;
-      }
-      unique_cnt++;
+    // Duplicates already seen sit between the unique tiles and j
+    if (unique_cnt != j) {
+      struct wfc__tile tmp = (*tiles)[unique_cnt];
+      (*tiles)[unique_cnt] = (*tiles)[j];
+      (*tiles)[j] = tmp;
+      keys[unique_cnt] = keys[j];
     }
+    slots[slot] = unique_cnt++;
   }
 
   for (int i = unique_cnt; i < *tile_cnt; i++)
     wfc_img_destroy((*tiles)[i].image);
 
+  // Keeps the larger array if it can't shrink
   struct wfc__tile *unique_tiles =
       realloc(*tiles, sizeof(**tiles) * unique_cnt);
-  if (unique_tiles == NULL) {
-    p("wfc__remove_duplicate_tiles: error\n");
-    return 0;
-  }
-
-  *tiles = unique_tiles;
+  if (unique_tiles != NULL) *tiles = unique_tiles;
   *tile_cnt = unique_cnt;
 
+  free(keys);
+  free(slots);
+
   return 1;
+
+CLEANUP:
+  p("wfc__remove_duplicate_tiles: error\n");
+  free(keys);
+  free(slots);
+  return 0;
 }
 
 static void wfc__destroy_props(struct wfc__prop *props) { free(props); }
 
 static struct wfc__prop *wfc__create_props(int cell_cnt) {
-  struct wfc__prop *props =
-      malloc(sizeof(*props) * cell_cnt * WFC_MAX_PROP_CNT);
+  struct wfc__prop *props = malloc(sizeof(*props) * cell_cnt * 4);
   return props;
 }
 
 static void wfc__destroy_cells(struct wfc__cell *cells, int cell_cnt) {
-  free(cells[0].tiles);
   free(cells);
 }
 
 // Return NULL on error
-static struct wfc__cell *wfc__create_cells(int cell_cnt, int tile_cnt) {
+static struct wfc__cell *wfc__create_cells(int cell_cnt) {
   struct wfc__cell *cells = malloc(sizeof(*cells) * cell_cnt);
-  if (cells == NULL) goto CLEANUP;
-
-  for (int i = 0; i < cell_cnt; i++) cells[i].tiles = NULL;
-
-  cells[0].tiles = malloc(sizeof(*(cells[0].tiles)) * tile_cnt * cell_cnt);
-  for (int i = 1; i < cell_cnt; i++) {
-    cells[i].tiles = cells[0].tiles + i * tile_cnt;
-    if (cells[i].tiles == NULL) goto CLEANUP;
+  if (cells == NULL) {
+    p("wfc__create_cells: error\n");
+    return NULL;
   }
 
   return cells;
+}
 
-CLEANUP:
-  p("wfc__create_cells: error\n");
-  wfc__destroy_cells(cells, cell_cnt);
-  return NULL;
+static void wfc__destroy_wave(uint64_t *wave) { free(wave); }
+
+static void wfc__destroy_supports(int *supports) { free(supports); }
+
+// Return NULL on error
+static int *wfc__create_supports(int cell_cnt, int tile_cnt) {
+  int *supports = malloc(sizeof(*supports) * (size_t)cell_cnt * tile_cnt * 4);
+  if (supports == NULL) {
+    p("wfc__create_supports: error\n");
+  }
+  return supports;
+}
+
+// Return NULL on error
+static uint64_t *wfc__create_wave(int cell_cnt, int tile_words) {
+  uint64_t *wave = malloc(sizeof(*wave) * (size_t)cell_cnt * tile_words);
+  if (wave == NULL) {
+    p("wfc__create_wave: error\n");
+  }
+  return wave;
 }
 
 static void wfc__destroy_tiles(struct wfc__tile *tiles, int tile_cnt) {
@@ -688,37 +957,84 @@ CLEANUP:
   return NULL;
 }
 
-static void wfc__destroy_allowed_tiles(int *allowed_tiles[4]) {
-  free(allowed_tiles[0]);
-}
+static void wfc__destroy_compat(uint64_t *compat[4]) { free(compat[0]); }
 
 // Return 0 on error
-static int wfc__create_allowed_tiles(int *allowed_tiles[4], int tile_cnt) {
-  allowed_tiles[0] =
-      malloc(sizeof(*allowed_tiles[0]) * tile_cnt * tile_cnt * 4);
-  for (int i = 1; i < 4; i++)
-    allowed_tiles[i] = allowed_tiles[0] + i * tile_cnt * tile_cnt;
+static int wfc__create_compat(uint64_t *compat[4], int tile_cnt,
+                              int tile_words) {
+  size_t words = (size_t)tile_cnt * tile_words;
+  compat[0] = calloc(words * 4, sizeof(*compat[0]));
+  if (compat[0] == NULL) {
+    p("wfc__create_compat: error\n");
+    return 0;
+  }
+
+  for (int i = 1; i < 4; i++) compat[i] = compat[0] + i * words;
 
   return 1;
+}
 
-CLEANUP:
-  p("wfc__create_allowed_tiles: error\n");
-  wfc__destroy_allowed_tiles(allowed_tiles);
+// Return the neighbouring cell in the direction, -1 past the output edge
+static int wfc__neighbour(struct wfc *wfc, int cell_idx,
+                          enum wfc__direction d) {
+  int x = cell_idx % wfc->output_width;
+  switch (d) {
+    case WFC_UP:
+      return cell_idx >= wfc->output_width ? cell_idx - wfc->output_width
+                                           : -1;
+    case WFC_DOWN:
+      return cell_idx + wfc->output_width < wfc->cell_cnt
+                 ? cell_idx + wfc->output_width
+                 : -1;
+    case WFC_LEFT:
+      return x != 0 ? cell_idx - 1 : -1;
+    case WFC_RIGHT:
+      return x != wfc->output_width - 1 ? cell_idx + 1 : -1;
+  }
+  return -1;
+}
 
-  return 0;
+static inline int wfc__prop_bit(int cell_idx, enum wfc__direction d) {
+  return cell_idx * 4 + d;
 }
 
+// Queues a prop unless the same one is already pending
 static void wfc__add_prop(struct wfc *wfc, int src_cell_idx, int dst_cell_idx,
                           enum wfc__direction direction) {
-  // TODO: check for wfc->prop_cnt == WFC_MAX_PROP_CNT
-
-  struct wfc__prop *p = &(wfc->props[wfc->prop_cnt]);
+  int bit = wfc__prop_bit(src_cell_idx, direction);
+  uint64_t mask = 1ULL << (bit % 64);
+  if (wfc->prop_pending[bit / 64] & mask) return;
+  wfc->prop_pending[bit / 64] |= mask;
+
+  int cap = wfc->cell_cnt * 4;
+  int i = wfc->prop_idx + wfc->prop_cnt;
+  struct wfc__prop *p = &(wfc->props[i < cap ? i : i - cap]);
   (wfc->prop_cnt)++;
   p->src_cell_idx = src_cell_idx;
   p->dst_cell_idx = dst_cell_idx;
   p->direction = direction;
 }
 
+// Return 0 when the queue is empty
+static int wfc__pop_prop(struct wfc *wfc, struct wfc__prop *p) {
+  if (!wfc->prop_cnt) return 0;
+
+  *p = wfc->props[wfc->prop_idx];
+  if (++wfc->prop_idx == wfc->cell_cnt * 4) wfc->prop_idx = 0;
+  (wfc->prop_cnt)--;
+
+  int bit = wfc__prop_bit(p->src_cell_idx, p->direction);
+  wfc->prop_pending[bit / 64] &= ~(1ULL << (bit % 64));
+  return 1;
+}
+
+static void wfc__clear_props(struct wfc *wfc) {
+  wfc->prop_cnt = 0;
+  wfc->prop_idx = 0;
+  memset(wfc->prop_pending, 0,
+         sizeof(*wfc->prop_pending) * ((wfc->cell_cnt * 4 + 63) / 64));
+}
+
 // add prop to update cell above the cell_idx
 static void wfc__add_prop_up(struct wfc *wfc, int src_cell_idx) {
   if (src_cell_idx - wfc->output_width >= 0) {
@@ -745,106 +1061,230 @@ static void wfc__add_prop_right(struct wfc *wfc, int src_cell_idx) {
   }
 }
 
-// Does the cell enable tile in the direction?
-static int wfc__tile_enabled(struct wfc *wfc, int tile_idx, int cell_idx,
-                             enum wfc__direction d) {
-  struct wfc__cell *cell = &(wfc->cells[cell_idx]);
-  int *tiles = cell->tiles;
+static inline double wfc__heap_key(struct wfc *wfc, int heap_idx) {
+  struct wfc__cell *cell = &(wfc->cells[wfc->heap[heap_idx]]);
+  return cell->entropy + cell->noise;
+}
 
-  // Tile is enabled if any of the cell's tiles allowes it in
-  // the specified diretion
-  int tile_cnt = wfc->tile_cnt;
-  for (int i = 0, cnt = cell->tile_cnt; i < cnt; i++) {
-    if (wfc->allowed_tiles[d][tiles[i] * tile_cnt + tile_idx]) {
-      return 1;
-    }
-  }
+static inline void wfc__heap_swap(struct wfc *wfc, int a, int b) {
+  int cell_a = wfc->heap[a];
+  int cell_b = wfc->heap[b];
+  wfc->heap[a] = cell_b;
+  wfc->heap[b] = cell_a;
+  wfc->heap_pos[cell_b] = a;
+  wfc->heap_pos[cell_a] = b;
+}
 
-  return 0;
+static void wfc__heap_sift_up(struct wfc *wfc, int heap_idx) {
+  while (heap_idx > 0) {
+    int parent = (heap_idx - 1) / 2;
+    if (wfc__heap_key(wfc, parent) <= wfc__heap_key(wfc, heap_idx)) break;
+    wfc__heap_swap(wfc, parent, heap_idx);
+    heap_idx = parent;
+  }
 }
 
-// Checks whether particular prop is already added and pending, in which
-// case there is no point of adding the same prop again.
-//
-// 1 - prop is added, 0 - prop is not added
-static int wfc__is_prop_pending(struct wfc *wfc, int cell_idx,
-                                enum wfc__direction d) {
-  for (int i = wfc->prop_idx + 1; i < wfc->prop_cnt; i++) {
-    struct wfc__prop *p = &(wfc->props[i]);
-    if (p->src_cell_idx == cell_idx && p->direction == d) {
-      return 1;
-    }
+static void wfc__heap_sift_down(struct wfc *wfc, int heap_idx) {
+  while (1) {
+    int min = heap_idx;
+    int l = heap_idx * 2 + 1;
+    int r = l + 1;
+    if (l < wfc->heap_cnt && wfc__heap_key(wfc, l) < wfc__heap_key(wfc, min))
+      min = l;
+    if (r < wfc->heap_cnt && wfc__heap_key(wfc, r) < wfc__heap_key(wfc, min))
+      min = r;
+    if (min == heap_idx) break;
+    wfc__heap_swap(wfc, min, heap_idx);
+    heap_idx = min;
   }
-  return 0;
 }
 
-// Updates tiles in the destination cell to those that are allowed by the source
-// cell and propagate updates
-//
-// Return 0 on error
-static int wfc__propagate_prop(struct wfc *wfc, struct wfc__prop *p) {
-  int new_cnt = 0;
+// The cell's entropy only ever drops, so it can only move up
+static void wfc__heap_update(struct wfc *wfc, int cell_idx) {
+  if (wfc->heap_cnt < 0 || wfc->heap_pos[cell_idx] < 0) return;
+  wfc__heap_sift_up(wfc, wfc->heap_pos[cell_idx]);
+}
 
-  struct wfc__cell *dst_cell = &(wfc->cells[p->dst_cell_idx]);
+static void wfc__heap_remove(struct wfc *wfc, int cell_idx) {
+  if (wfc->heap_cnt < 0) return;
 
-  // Go through all destination tiles and check whether they are enabled by the
-  // source cell
-  for (int i = 0, cnt = dst_cell->tile_cnt; i < cnt; i++) {
-    int possible_dst_tile_idx = dst_cell->tiles[i];
+  int heap_idx = wfc->heap_pos[cell_idx];
+  if (heap_idx < 0) return;
 
-    // If a destination tile is enabled by the source cell, keep it
-    if (wfc__tile_enabled(wfc, possible_dst_tile_idx, p->src_cell_idx,
-                          p->direction)) {
-      dst_cell->tiles[new_cnt] = possible_dst_tile_idx;
-      new_cnt++;
-    } else {
-      int freq = wfc->tiles[possible_dst_tile_idx].freq;
-      double p = ((double)freq) / wfc->sum_freqs;
-      dst_cell->entropy += p * log(p);
-      dst_cell->sum_freqs -= freq;
-      if (dst_cell->sum_freqs == 0)  // no options left TODO: remove
-        return 0;
-    }
+  int last = --wfc->heap_cnt;
+  if (heap_idx != last) {
+    wfc__heap_swap(wfc, heap_idx, last);
+    wfc__heap_sift_up(wfc, heap_idx);
+    wfc__heap_sift_down(wfc, wfc->heap_pos[wfc->heap[heap_idx]]);
   }
+  wfc->heap_pos[cell_idx] = -1;
+}
 
-  if (!new_cnt) {
-    return 0;
+// Small noise added to the entropy to break ties between cells, picked
+// once per run
+static void wfc__pick_noise(struct wfc *wfc) {
+  for (int i = 0; i < wfc->cell_cnt; i++) {
+    wfc->cells[i].noise = wfc__rand_01(wfc) / 100000.0;
   }
+}
 
-  if (dst_cell->tile_cnt != new_cnt) {
-    if (new_cnt == 1) wfc->collapsed_cell_cnt++;
-    if (p->direction != WFC_DOWN &&
-        !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_UP))
-      wfc__add_prop_up(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_UP &&
-        !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_DOWN))
-      wfc__add_prop_down(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_RIGHT &&
-        !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_LEFT))
-      wfc__add_prop_left(wfc, p->dst_cell_idx);
-    if (p->direction != WFC_LEFT &&
-        !wfc__is_prop_pending(wfc, p->dst_cell_idx, WFC_RIGHT))
-      wfc__add_prop_right(wfc, p->dst_cell_idx);
+// Heapifies the cells not yet collapsed
+static void wfc__heap_build(struct wfc *wfc) {
+  wfc->heap_cnt = 0;
+  for (int i = 0; i < wfc->cell_cnt; i++) {
+    wfc->heap_pos[i] = -1;
+    if (wfc->cells[i].tile_cnt != 1) {
+      wfc->heap[wfc->heap_cnt] = i;
+      wfc->heap_pos[i] = wfc->heap_cnt++;
+    }
   }
 
-  dst_cell->tile_cnt = new_cnt;
+  for (int i = wfc->heap_cnt / 2 - 1; i >= 0; i--) wfc__heap_sift_down(wfc, i);
+}
 
-  return 1;
+// Forgets every decision, they can no longer be undone
+static void wfc__clear_decisions(struct wfc *wfc) {
+  wfc->decision_cnt = 0;
+  wfc->journal_base = 0;
+  wfc->journal_cnt = 0;
+}
+
+static void wfc__journal_ban(struct wfc *wfc, int cell_idx, int tile_idx) {
+  if (!wfc->decision_cnt) return;
+
+  if (wfc->journal_cnt == wfc->journal_cap && wfc->journal_base &&
+      wfc->journal_base >= wfc->journal_cap / 2) {
+    int live = wfc->journal_cnt - wfc->journal_base;
+    memmove(wfc->journal, wfc->journal + wfc->journal_base,
+            sizeof(*wfc->journal) * live);
+    for (int i = 0; i < wfc->decision_cnt; i++)
+      wfc->decisions[i].journal_idx -= wfc->journal_base;
+    wfc->journal_cnt = live;
+    wfc->journal_base = 0;
+  }
+
+  if (wfc->journal_cnt == wfc->journal_cap) {
+    int cap = wfc->journal_cap ? wfc->journal_cap * 2 : 1024;
+    struct wfc__journal_entry *journal =
+        realloc(wfc->journal, sizeof(*journal) * cap);
+    if (journal == NULL) {
+      // Out of memory only costs the ability to backtrack
+      p("wfc__journal_ban: error\n");
+      wfc__clear_decisions(wfc);
+      return;
+    }
+    wfc->journal = journal;
+    wfc->journal_cap = cap;
+  }
+
+  struct wfc__cell *cell = &(wfc->cells[cell_idx]);
+  struct wfc__journal_entry *e = &(wfc->journal[wfc->journal_cnt++]);
+  e->cell_idx = cell_idx;
+  e->tile_idx = tile_idx;
+  e->sum_freqs = cell->sum_freqs;
+  e->entropy = cell->entropy;
 }
 
+// Removes a tile from the cell and queues the ban to be propagated to
+// every neighbour.
+//
 // Return 0 on error (contradiction)
-static int wfc__propagate(struct wfc *wfc, int cell_idx) {
-  wfc->prop_cnt = 0;
+static int wfc__ban(struct wfc *wfc, int cell_idx, int tile_idx) {
+  wfc__journal_ban(wfc, cell_idx, tile_idx);
+  wfc->attempt_ban_cnt++;
+
+  uint64_t *tiles = wfc__cell_tiles(wfc, cell_idx);
+  tiles[tile_idx / 64] &= ~(1ULL << (tile_idx % 64));
+
+  struct wfc__cell *cell = &(wfc->cells[cell_idx]);
+  int freq = wfc->tiles[tile_idx].freq;
+  double p = ((double)freq) / wfc->sum_freqs;
+  cell->entropy += p * log(p);
+  cell->sum_freqs -= freq;
+  cell->tile_cnt--;
+
+  // Marked even on a contradiction so an undo knows the ban never
+  // reached the neighbours
+  for (int d = 0; d < 4; d++) {
+    wfc__tiles_set(wfc__cell_removed(wfc, cell_idx, d), tile_idx);
+  }
+
+  if (!cell->tile_cnt) {
+    return 0;
+  }
+  if (cell->tile_cnt == 1) {
+    wfc->collapsed_cell_cnt++;
+    wfc__heap_remove(wfc, cell_idx);
+  } else {
+    wfc__heap_update(wfc, cell_idx);
+  }
 
   wfc__add_prop_up(wfc, cell_idx);
   wfc__add_prop_down(wfc, cell_idx);
   wfc__add_prop_left(wfc, cell_idx);
   wfc__add_prop_right(wfc, cell_idx);
 
-  for (int i = 0; i < wfc->prop_cnt; i++) {
-    wfc->prop_idx = i;
-    struct wfc__prop *p = &(wfc->props[i]);
-    if (!wfc__propagate_prop(wfc, p)) {
+  return 1;
+}
+
+// Takes the support of the source cell's newly banned tiles away from the
+// tiles they enabled in the destination cell, banning those left without
+// any. The work is proportional to the bans, not to the tiles still
+// possible on either side.
+//
+// With backtracking on, supports of tiles already banned are decremented
+// too, so the count changes depend only on which bans were propagated and
+// can be undone. A source tile's bit is cleared only after all its
+// supports are taken.
+//
+// Return 0 on error
+static int wfc__propagate_prop(struct wfc *wfc, struct wfc__prop *p) {
+  int words = wfc->tile_words;
+  uint64_t *removed = wfc__cell_removed(wfc, p->src_cell_idx, p->direction);
+  uint64_t *dst_tiles = wfc__cell_tiles(wfc, p->dst_cell_idx);
+  uint64_t *compat = wfc->compat[p->direction];
+  int *dst_supports =
+      &wfc->supports[(size_t)p->dst_cell_idx * wfc->tile_cnt * 4];
+  uint64_t keep = wfc->backtrack_depth ? ~0ULL : 0;
+  int ok = 1;
+
+  for (int w = 0; w < words; w++) {
+    while (removed[w]) {
+      int src_tile_idx = w * 64 + __builtin_ctzll(removed[w]);
+
+      uint64_t *src_compat = &compat[(size_t)src_tile_idx * words];
+      for (int dw = 0; dw < words; dw++) {
+        uint64_t enabled = src_compat[dw] & (dst_tiles[dw] | keep);
+        while (enabled) {
+          int dst_tile_idx = dw * 64 + __builtin_ctzll(enabled);
+          enabled &= enabled - 1;
+
+          if (--dst_supports[dst_tile_idx * 4 + p->direction] == 0 &&
+              wfc__tiles_get(dst_tiles, dst_tile_idx) &&
+              !wfc__ban(wfc, p->dst_cell_idx, dst_tile_idx)) {
+            ok = 0;
+          }
+        }
+      }
+
+      removed[w] &= removed[w] - 1;
+      if (!ok) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Propagates every queued prop
+//
+// Return 0 on error (contradiction)
+static int wfc__propagate(struct wfc *wfc) {
+  struct wfc__prop p;
+  while (wfc__pop_prop(wfc, &p)) {
+    if (!wfc__propagate_prop(wfc, &p)) {
+      wfc__clear_props(wfc);
       return 0;
     }
   }
@@ -854,17 +1294,39 @@ static int wfc__propagate(struct wfc *wfc, int cell_idx) {
 
 // Return 0 on error (contradiction)
 static int wfc__collapse(struct wfc *wfc, int cell_idx) {
-  int remaining = rand() % wfc->cells[cell_idx].sum_freqs;
-  for (int i = 0; i < wfc->cells[cell_idx].tile_cnt; i++) {
-    int freq = wfc->tiles[wfc->cells[cell_idx].tiles[i]].freq;
+  uint64_t *tiles = wfc__cell_tiles(wfc, cell_idx);
+  int remaining = wfc__rand_below(wfc, wfc->cells[cell_idx].sum_freqs);
+  WFC__FOREACH_TILE(tile_idx, tiles, wfc->tile_words) {
+    int freq = wfc->tiles[tile_idx].freq;
     if (remaining >= freq) {
       remaining -= freq;
     } else {
-      wfc->cells[cell_idx].tiles[0] = wfc->cells[cell_idx].tiles[i];
+      // Every other tile is banned, wfc__propagate pushes the bans out
+      WFC__FOREACH_TILE(banned_idx, tiles, wfc->tile_words) {
+        if (banned_idx == tile_idx) continue;
+        wfc__journal_ban(wfc, cell_idx, banned_idx);
+        wfc->attempt_ban_cnt++;
+      }
+      for (int d = 0; d < 4; d++) {
+        uint64_t *removed = wfc__cell_removed(wfc, cell_idx, d);
+        for (int w = 0; w < wfc->tile_words; w++) removed[w] |= tiles[w];
+        removed[tile_idx / 64] &= ~(1ULL << (tile_idx % 64));
+      }
+      memset(tiles, 0, sizeof(*tiles) * wfc->tile_words);
+      wfc__tiles_set(tiles, tile_idx);
       wfc->cells[cell_idx].tile_cnt = 1;
       wfc->cells[cell_idx].sum_freqs = 0;
       wfc->cells[cell_idx].entropy = 0;
       wfc->collapsed_cell_cnt++;
+      wfc__heap_remove(wfc, cell_idx);
+
+      wfc__add_prop_up(wfc, cell_idx);
+      wfc__add_prop_down(wfc, cell_idx);
+      wfc__add_prop_left(wfc, cell_idx);
+      wfc__add_prop_right(wfc, cell_idx);
+
+      if (wfc->decision_cnt)
+        wfc->decisions[wfc->decision_cnt - 1].tile_idx = tile_idx;
       return 1;
     }
   }
@@ -872,20 +1334,101 @@ static int wfc__collapse(struct wfc *wfc, int cell_idx) {
   return 0;
 }
 
-static int wfc__next_cell(struct wfc *wfc) {
-  int min_idx = -1;
-  double min_entropy = DBL_MAX;
+// Records a decision about to be made in the cell, dropping the oldest
+// one when the window is full
+static void wfc__add_decision(struct wfc *wfc, int cell_idx) {
+  if (!wfc->backtrack_depth) return;
+
+  if (wfc->decision_cnt == wfc->backtrack_depth) {
+    memmove(wfc->decisions, wfc->decisions + 1,
+            sizeof(*wfc->decisions) * (wfc->decision_cnt - 1));
+    wfc->decision_cnt--;
+    wfc->journal_base = wfc->decision_cnt ? wfc->decisions[0].journal_idx
+                                          : wfc->journal_cnt;
+  }
+  if (!wfc->decision_cnt) {
+    wfc->journal_base = 0;
+    wfc->journal_cnt = 0;
+  }
 
-  for (int i = 0; i < wfc->cell_cnt; i++) {
-    // Add small noise to break ties between tiles with the same entropy
-    double entropy = wfc->cells[i].entropy + rand() / (100000.0 * RAND_MAX);
-    if (wfc->cells[i].tile_cnt != 1 && entropy < min_entropy) {
-      min_entropy = entropy;
-      min_idx = i;
+  struct wfc__decision *d = &(wfc->decisions[wfc->decision_cnt++]);
+  d->cell_idx = cell_idx;
+  d->tile_idx = -1;
+  d->journal_idx = wfc->journal_cnt;
+  d->collapsed_cell_cnt = wfc->collapsed_cell_cnt;
+}
+
+// Undoes journaled bans back to journal_idx, most recent first. A ban whose
+// bit is still in the cell's removed set never reached that neighbour,
+// otherwise the supports it took are given back.
+static void wfc__undo_bans(struct wfc *wfc, int journal_idx) {
+  int words = wfc->tile_words;
+  for (int i = wfc->journal_cnt - 1; i >= journal_idx; i--) {
+    struct wfc__journal_entry *e = &(wfc->journal[i]);
+    uint64_t bit = 1ULL << (e->tile_idx % 64);
+    int w = e->tile_idx / 64;
+
+    for (int d = 0; d < 4; d++) {
+      uint64_t *removed = wfc__cell_removed(wfc, e->cell_idx, d);
+      int n = wfc__neighbour(wfc, e->cell_idx, d);
+      if (removed[w] & bit) {
+        removed[w] &= ~bit;
+      } else if (n != -1) {
+        int *supports = &wfc->supports[(size_t)n * wfc->tile_cnt * 4];
+        uint64_t *tile_compat = &wfc->compat[d][(size_t)e->tile_idx * words];
+        WFC__FOREACH_TILE(tile_idx, tile_compat, words) {
+          supports[tile_idx * 4 + d]++;
+        }
+      }
+    }
+
+    struct wfc__cell *cell = &(wfc->cells[e->cell_idx]);
+    wfc__cell_tiles(wfc, e->cell_idx)[w] |= bit;
+    cell->tile_cnt++;
+    cell->sum_freqs = e->sum_freqs;
+    cell->entropy = e->entropy;
+  }
+
+  long undone = wfc->journal_cnt - journal_idx;
+  wfc->attempt_ban_cnt -= undone;
+  wfc->stats.wasted_bans += undone;
+  wfc->journal_cnt = journal_idx;
+}
+
+// Undoes decisions, most recent first, and bans the undone pick from its
+// cell until that propagates without a contradiction. An attempt gets
+// four backtracks per decision kept, past that the contradiction most
+// likely goes back further than the decisions kept and restarting is
+// quicker.
+//
+// Return 0 when no decision is left to undo or the attempt is out of
+// backtracks
+static int wfc__backtrack(struct wfc *wfc) {
+  wfc__clear_props(wfc);
+
+  while (wfc->decision_cnt &&
+         wfc->attempt_backtrack_cnt < wfc->backtrack_depth * 4) {
+    struct wfc__decision d = wfc->decisions[--wfc->decision_cnt];
+    wfc__undo_bans(wfc, d.journal_idx);
+    wfc->collapsed_cell_cnt = d.collapsed_cell_cnt;
+    wfc->attempt_decision_cnt--;
+    wfc->attempt_backtrack_cnt++;
+    wfc->stats.backtracks++;
+    wfc->stats.wasted_decisions++;
+    wfc__heap_build(wfc);
+
+    if (d.tile_idx != -1 && wfc__ban(wfc, d.cell_idx, d.tile_idx) &&
+        wfc__propagate(wfc)) {
+      return 1;
     }
+    wfc__clear_props(wfc);
   }
 
-  return min_idx;
+  return 0;
+}
+
+static int wfc__next_cell(struct wfc *wfc) {
+  return wfc->heap_cnt > 0 ? wfc->heap[0] : -1;
 }
 
 static void wfc__init_cells(struct wfc *wfc) {
@@ -904,46 +1447,217 @@ static void wfc__init_cells(struct wfc *wfc) {
     wfc->cells[i].tile_cnt = wfc->tile_cnt;
     wfc->cells[i].sum_freqs = sum_freqs;
     wfc->cells[i].entropy = entropy;
-    for (int j = 0; j < wfc->tile_cnt; j++) {
-      wfc->cells[i].tiles[j] = j;
+
+    uint64_t *tiles = wfc__cell_tiles(wfc, i);
+    memset(tiles, 0, sizeof(*tiles) * wfc->tile_words);
+    for (int j = 0; j < wfc->tile_cnt; j++) wfc__tiles_set(tiles, j);
+
+    memcpy(&wfc->supports[(size_t)i * wfc->tile_cnt * 4], wfc->init_supports,
+           sizeof(*wfc->supports) * wfc->tile_cnt * 4);
+  }
+  memset(wfc->removed, 0,
+         sizeof(*wfc->removed) * (size_t)wfc->cell_cnt * 4 * wfc->tile_words);
+
+  wfc__clear_props(wfc);
+  wfc__clear_decisions(wfc);
+  wfc->collapsed_cell_cnt = 0;
+  wfc->attempt_decision_cnt = 0;
+  wfc->attempt_ban_cnt = 0;
+  wfc->attempt_backtrack_cnt = 0;
+  wfc->heap_cnt = -1;
+}
+
+// Bans the cell's tiles whose output pixel isn't the one it's pinned to,
+// or every tile but the one it's pinned to
+//
+// Return 0 on error (contradiction)
+static int wfc__apply_constraint(struct wfc *wfc, int cell_idx) {
+  const unsigned char *pixel =
+      &wfc->constraints[(size_t)cell_idx * wfc->component_cnt];
+  int pinned_tile = wfc->constraint_tiles[cell_idx];
+  WFC__FOREACH_TILE(tile_idx, wfc__cell_tiles(wfc, cell_idx),
+                    wfc->tile_words) {
+    int banned = pinned_tile != -1
+                     ? tile_idx != pinned_tile
+                     : memcmp(wfc->tiles[tile_idx].image->data, pixel,
+                              wfc->component_cnt) != 0;
+    if (banned && !wfc__ban(wfc, cell_idx, tile_idx)) {
+      wfc__clear_props(wfc);
+      return 0;
     }
   }
 
-  wfc->prop_cnt = 0;
+  return wfc__propagate(wfc);
+}
+
+// Return 0 on error (contradiction)
+static int wfc__apply_constraints(struct wfc *wfc) {
+  int words = (wfc->cell_cnt + 63) / 64;
+  WFC__FOREACH_TILE(cell_idx, wfc->constrained, words) {
+    if (!wfc__apply_constraint(wfc, cell_idx)) return 0;
+  }
+  return 1;
 }
 
-// Allows to call wfc_run again
+// Allows to call wfc_run again. The random numbers carry on rather than
+// restart, so running again tries something new.
 void wfc_init(struct wfc *wfc) {
-  wfc->seed = (unsigned int)time(NULL);  // 1641743677
-  srand(wfc->seed);
-  wfc->collapsed_cell_cnt = 0;
+  memset(&wfc->stats, 0, sizeof(wfc->stats));
+  wfc->restart_cnt = 0;
+  memset(wfc->constrained, 0,
+         sizeof(*wfc->constrained) * ((wfc->cell_cnt + 63) / 64));
   wfc__init_cells(wfc);
 }
 
-// max_collapse_cnt of -1 means no iteration number limit
+// Seeds the instance's random numbers, the same seed and calls give the
+// same output
+void wfc_seed(struct wfc *wfc, unsigned int seed) {
+  wfc->seed = seed;
+  wfc->rng = seed;
+}
+
+// Pins the output pixel at (x, y), e.g. to the already generated border
+// of a neighbouring region. Constraints last until wfc_init and are
+// reapplied when wfc_run restarts.
 //
-// Return 0 on error (contradiction occurred)
-int wfc_run(struct wfc *wfc, int max_collapse_cnt) {
-  // int cell_idx = (wfc->output_height / 2) * wfc->output_width +
-  // wfc->output_width / 2;
-  int cell_idx = rand() % (wfc->output_height * wfc->output_width);
+// Return 0 on error (the constraints contradict each other)
+int wfc_constrain(struct wfc *wfc, int x, int y, const unsigned char *pixel) {
+  int cell_idx = y * wfc->output_width + x;
+  memcpy(&wfc->constraints[(size_t)cell_idx * wfc->component_cnt], pixel,
+         wfc->component_cnt);
+  wfc->constrained[cell_idx / 64] |= 1ULL << (cell_idx % 64);
+  wfc->constraint_tiles[cell_idx] = -1;
+
+  return wfc__apply_constraint(wfc, cell_idx);
+}
 
-  while (1) {
-    print_progress(wfc->collapsed_cell_cnt);
+// Pins the cell at (x, y) to the tile, which also pins the pixels the
+// tile overlaps past the output's edge
+//
+// Return 0 on error (the constraints contradict each other)
+static int wfc__constrain_tile(struct wfc *wfc, int x, int y, int tile_idx) {
+  int cell_idx = y * wfc->output_width + x;
+  if (!wfc_constrain(wfc, x, y, wfc->tiles[tile_idx].image->data)) return 0;
 
-    if (!wfc__collapse(wfc, cell_idx)) {
-      print_endprogress();
-      return 0;
-    }
+  wfc->constraint_tiles[cell_idx] = tile_idx;
+  return wfc__apply_constraint(wfc, cell_idx);
+}
 
-    if (!wfc__propagate(wfc, cell_idx)) {
-      print_endprogress();
+// Return 0 on error
+int wfc_set_backtracking(struct wfc *wfc, int depth, int max_restarts) {
+  struct wfc__decision *decisions = NULL;
+  if (depth > 0) {
+    decisions = malloc(sizeof(*decisions) * depth);
+    if (decisions == NULL) {
+      p("wfc_set_backtracking: error\n");
       return 0;
     }
+  }
 
-    cell_idx = wfc__next_cell(wfc);
+  free(wfc->decisions);
+  wfc->decisions = decisions;
+  wfc->backtrack_depth = depth > 0 ? depth : 0;
+  wfc->max_restarts = max_restarts > 0 ? max_restarts : 0;
+  wfc__clear_decisions(wfc);
+  return 1;
+}
 
-    if (cell_idx == -1 || wfc->collapsed_cell_cnt == max_collapse_cnt) {
+struct wfc_stats wfc_get_stats(struct wfc *wfc) { return wfc->stats; }
+
+// Return the number of neighbouring pairs of collapsed cells whose tiles
+// the rules don't allow in that direction
+int wfc_broken_rules(struct wfc *wfc) {
+  int broken = 0;
+  for (int cell_idx = 0; cell_idx < wfc->cell_cnt; cell_idx++) {
+    if (wfc->cells[cell_idx].tile_cnt != 1) continue;
+    int tile_idx =
+        wfc__tiles_next(wfc__cell_tiles(wfc, cell_idx), wfc->tile_words, 0);
+
+    for (int d = 0; d < 4; d++) {
+      int neighbour = wfc__neighbour(wfc, cell_idx, d);
+      if (neighbour == -1 || wfc->cells[neighbour].tile_cnt != 1) continue;
+
+      int neighbour_tile = wfc__tiles_next(wfc__cell_tiles(wfc, neighbour),
+                                           wfc->tile_words, 0);
+      broken += !wfc__tiles_get(
+          &wfc->compat[d][(size_t)tile_idx * wfc->tile_words], neighbour_tile);
+    }
+  }
+  return broken;
+}
+
+// Collapses the cell and propagates
+//
+// Return 0 on error (contradiction)
+static int wfc__decide(struct wfc *wfc, int cell_idx) {
+  wfc__add_decision(wfc, cell_idx);
+  wfc->stats.decisions++;
+  wfc->attempt_decision_cnt++;
+
+  return wfc__collapse(wfc, cell_idx) && wfc__propagate(wfc);
+}
+
+// A random cell to start from, or the best one if that is already
+// collapsed by a constraint
+static int wfc__first_cell(struct wfc *wfc) {
+  // int cell_idx = (wfc->output_height / 2) * wfc->output_width +
+  // wfc->output_width / 2;
+  int cell_idx = wfc__rand_below(wfc, wfc->cell_cnt);
+  if (wfc->cells[cell_idx].tile_cnt == 1) cell_idx = wfc__next_cell(wfc);
+  return cell_idx;
+}
+
+// A wfc_run_parallel attempt below this one has already succeeded
+static int wfc__outrun(struct wfc *wfc) {
+  return wfc->winner && atomic_load_explicit(wfc->winner,
+                                             memory_order_relaxed) <
+                            wfc->clone_idx;
+}
+
+// max_collapse_cnt of -1 means no iteration number limit
+//
+// Return 0 on error (contradiction occurred and couldn't be backtracked
+// out of within max_restarts restarts, or outrun by another attempt)
+int wfc_run(struct wfc *wfc, int max_collapse_cnt) {
+  if (wfc->heap_cnt < 0) {
+    wfc__pick_noise(wfc);
+    wfc__heap_build(wfc);
+  }
+
+  int cell_idx = wfc__first_cell(wfc);
+
+  while (cell_idx != -1) {
+    print_progress(wfc->collapsed_cell_cnt);
+
+    if (wfc__outrun(wfc)) {
+      print_endprogress();
+      return 0;
+    }
+
+    if (!wfc__decide(wfc, cell_idx) && !wfc__backtrack(wfc)) {
+      if (wfc->restart_cnt >= wfc->max_restarts) {
+        print_endprogress();
+        return 0;
+      }
+
+      wfc->restart_cnt++;
+      wfc->stats.restarts++;
+      wfc->stats.wasted_decisions += wfc->attempt_decision_cnt;
+      wfc->stats.wasted_bans += wfc->attempt_ban_cnt;
+      wfc__init_cells(wfc);
+      if (!wfc__apply_constraints(wfc)) {
+        print_endprogress();
+        return 0;
+      }
+      wfc__pick_noise(wfc);
+      wfc__heap_build(wfc);
+      cell_idx = wfc__first_cell(wfc);
+      continue;
+    }
+
+    cell_idx = wfc__next_cell(wfc);
+
+    if (cell_idx == -1 || wfc->collapsed_cell_cnt == max_collapse_cnt) {
       break;
     }
   }
@@ -955,22 +1669,573 @@ int wfc_run(struct wfc *wfc, int max_collapse_cnt) {
 }
 
 void wfc_destroy(struct wfc *wfc) {
+  if (wfc == NULL) return;
+
+  for (int i = 0; i < wfc->clone_cnt; i++) wfc_destroy(wfc->clones[i]);
+  free(wfc->clones);
+
+  if (wfc->model == NULL) {
+    wfc__destroy_tiles(wfc->tiles, wfc->tile_cnt);
+    wfc__destroy_compat(wfc->compat);
+    wfc__destroy_supports(wfc->init_supports);
+  }
+
   wfc__destroy_cells(wfc->cells, wfc->cell_cnt);
-  wfc__destroy_tiles(wfc->tiles, wfc->tile_cnt);
-  wfc__destroy_allowed_tiles(wfc->allowed_tiles);
+  wfc__destroy_wave(wfc->wave);
+  wfc__destroy_supports(wfc->supports);
+  wfc__destroy_wave(wfc->removed);
   wfc__destroy_props(wfc->props);
+  free(wfc->prop_pending);
+  free(wfc->heap);
+  free(wfc->heap_pos);
+  free(wfc->decisions);
+  free(wfc->journal);
+  free(wfc->constraints);
+  free(wfc->constrained);
+  free(wfc->constraint_tiles);
   free(wfc);
 }
 
-static void wfc__compute_allowed_tiles(int *allowed_tiles[4],
-                                       struct wfc__tile *tiles, int tile_cnt) {
+// Output sized pointers of a wfc not allocated yet
+static void wfc__null_state(struct wfc *wfc) {
+  wfc->cells = NULL;
+  wfc->wave = NULL;
+  wfc->supports = NULL;
+  wfc->removed = NULL;
+  wfc->props = NULL;
+  wfc->prop_pending = NULL;
+  wfc->heap = NULL;
+  wfc->heap_pos = NULL;
+  wfc->journal = NULL;
+  wfc->journal_cap = 0;
+  wfc->constraints = NULL;
+  wfc->constrained = NULL;
+  wfc->constraint_tiles = NULL;
+  wfc->clones = NULL;
+  wfc->clone_cnt = 0;
+  wfc->winner = NULL;
+  wfc->clone_idx = 0;
+}
+
+// Allocates everything sized by the output
+//
+// Return 0 on error
+static int wfc__create_state(struct wfc *wfc) {
+  wfc->cells = wfc__create_cells(wfc->cell_cnt);
+  if (wfc->cells == NULL) return 0;
+
+  wfc->wave = wfc__create_wave(wfc->cell_cnt, wfc->tile_words);
+  if (wfc->wave == NULL) return 0;
+
+  wfc->supports = wfc__create_supports(wfc->cell_cnt, wfc->tile_cnt);
+  if (wfc->supports == NULL) return 0;
+
+  wfc->removed = wfc__create_wave(wfc->cell_cnt * 4, wfc->tile_words);
+  if (wfc->removed == NULL) return 0;
+
+  wfc->props = wfc__create_props(wfc->cell_cnt);
+  if (wfc->props == NULL) return 0;
+  wfc->prop_pending = malloc(sizeof(*wfc->prop_pending) *
+                             ((wfc->cell_cnt * 4 + 63) / 64));
+  if (wfc->prop_pending == NULL) return 0;
+
+  wfc->heap = malloc(sizeof(*wfc->heap) * wfc->cell_cnt);
+  if (wfc->heap == NULL) return 0;
+  wfc->heap_pos = malloc(sizeof(*wfc->heap_pos) * wfc->cell_cnt);
+  if (wfc->heap_pos == NULL) return 0;
+
+  wfc->constraints = malloc((size_t)wfc->cell_cnt * wfc->component_cnt);
+  if (wfc->constraints == NULL) return 0;
+  wfc->constrained =
+      malloc(sizeof(*wfc->constrained) * ((wfc->cell_cnt + 63) / 64));
+  if (wfc->constrained == NULL) return 0;
+  wfc->constraint_tiles =
+      malloc(sizeof(*wfc->constraint_tiles) * wfc->cell_cnt);
+  if (wfc->constraint_tiles == NULL) return 0;
+
+  return 1;
+}
+
+// A new instance sharing the tiles and rules of the model, which has to
+// outlive it, with its own output size, random numbers and backtracking
+// settings copied from the model
+//
+// Return NULL on error
+static struct wfc *wfc__create_instance(struct wfc *model, int output_width,
+                                        int output_height,
+                                        unsigned int seed) {
+  struct wfc *wfc = malloc(sizeof(*wfc));
+  if (wfc == NULL) goto CLEANUP;
+
+  *wfc = *model;
+  wfc->model = model;
+  wfc->decisions = NULL;
+  wfc__null_state(wfc);
+  wfc->output_width = output_width;
+  wfc->output_height = output_height;
+  wfc->cell_cnt = output_width * output_height;
+  wfc_seed(wfc, seed);
+
+  if (!wfc__create_state(wfc)) goto CLEANUP;
+  if (!wfc_set_backtracking(wfc, model->backtrack_depth,
+                            model->max_restarts))
+    goto CLEANUP;
+
+  wfc_init(wfc);
+
+  return wfc;
+
+CLEANUP:
+  p("wfc__create_instance: error\n");
+  wfc_destroy(wfc);
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Threads
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// An instance's share of a parallel run
+struct wfc__job {
+  pthread_t thread;
+  int started;
+  int (*fn)(struct wfc__job *job);
+  struct wfc *wfc;
+  int max_collapse_cnt;
+
+  // Regions of wfc_run_regions
+  struct wfc *parent;  // Instance the regions make up
+  int x;               // Region's first column in parent
+  struct wfc *left;    // Strips either side of a gap
+  struct wfc *right;
+
+  int rv;
+};
+
+static void *wfc__job_main(void *arg) {
+  struct wfc__job *job = arg;
+  job->rv = job->fn(job);
+  return NULL;
+}
+
+// Runs every job on its own thread, the calling thread takes the first
+// and any whose thread failed to start
+static void wfc__run_jobs(struct wfc__job *jobs, int job_cnt) {
+  for (int i = 1; i < job_cnt; i++) {
+    jobs[i].started =
+        !pthread_create(&jobs[i].thread, NULL, wfc__job_main, &jobs[i]);
+  }
+
+  wfc__job_main(&jobs[0]);
+  for (int i = 1; i < job_cnt; i++) {
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+    else
+      wfc__job_main(&jobs[i]);
+  }
+}
+
+static void wfc__add_stats(struct wfc_stats *sum, struct wfc_stats *stats) {
+  sum->decisions += stats->decisions;
+  sum->backtracks += stats->backtracks;
+  sum->restarts += stats->restarts;
+  sum->wasted_decisions += stats->wasted_decisions;
+  sum->wasted_bans += stats->wasted_bans;
+}
+
+// Takes over the generation state of an instance of the same size
+static void wfc__copy_state(struct wfc *dst, struct wfc *src) {
+  size_t cell_cnt = src->cell_cnt;
+  size_t words = src->tile_words;
+  memcpy(dst->cells, src->cells, sizeof(*dst->cells) * cell_cnt);
+  memcpy(dst->wave, src->wave, sizeof(*dst->wave) * cell_cnt * words);
+  memcpy(dst->supports, src->supports,
+         sizeof(*dst->supports) * cell_cnt * src->tile_cnt * 4);
+  memcpy(dst->removed, src->removed,
+         sizeof(*dst->removed) * cell_cnt * 4 * words);
+  memcpy(dst->constraints, src->constraints, cell_cnt * src->component_cnt);
+  memcpy(dst->constrained, src->constrained,
+         sizeof(*dst->constrained) * ((cell_cnt + 63) / 64));
+  memcpy(dst->constraint_tiles, src->constraint_tiles,
+         sizeof(*dst->constraint_tiles) * cell_cnt);
+
+  wfc__clear_props(dst);
+  wfc__clear_decisions(dst);
+  dst->collapsed_cell_cnt = src->collapsed_cell_cnt;
+  dst->attempt_decision_cnt = 0;
+  dst->attempt_ban_cnt = 0;
+  dst->attempt_backtrack_cnt = 0;
+  dst->restart_cnt = 0;
+  dst->heap_cnt = -1;
+}
+
+// Copies the cells of w columns from src_x in src to dst_x in dst, the
+// instances being the same height
+static void wfc__copy_columns(struct wfc *dst, int dst_x, struct wfc *src,
+                              int src_x, int w) {
+  for (int y = 0; y < src->output_height; y++) {
+    int dst_idx = y * dst->output_width + dst_x;
+    int src_idx = y * src->output_width + src_x;
+    memcpy(&dst->cells[dst_idx], &src->cells[src_idx],
+           sizeof(*dst->cells) * w);
+    memcpy(wfc__cell_tiles(dst, dst_idx), wfc__cell_tiles(src, src_idx),
+           sizeof(*dst->wave) * w * dst->tile_words);
+  }
+}
+
+// Pins the columns [x0, x1) of the region to the parent's constraints
+//
+// Return 0 on error (contradiction)
+static int wfc__constrain_region(struct wfc__job *job, int x0, int x1) {
+  struct wfc *parent = job->parent;
+  for (int y = 0; y < job->wfc->output_height; y++) {
+    for (int x = x0; x < x1; x++) {
+      int cell_idx = y * parent->output_width + job->x + x;
+      if (!wfc__tiles_get(parent->constrained, cell_idx)) continue;
+
+      const unsigned char *pixel =
+          &parent->constraints[(size_t)cell_idx * parent->component_cnt];
+      if (!wfc_constrain(job->wfc, x, y, pixel)) return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Pins w columns of the region from x to the output of src from src_x.
+// Column x + tile_i is pinned to src's tiles, which keeps the region's
+// tiles there allowed next to src's even in the bottom rows, where a tile
+// overlaps pixels past the output that no pixel pin reaches.
+//
+// Return 0 on error (contradiction)
+static int wfc__constrain_border(struct wfc *wfc, int x, struct wfc *src,
+                                 int src_x, int w, int tile_i) {
+  for (int y = 0; y < wfc->output_height; y++) {
+    for (int i = 0; i < w; i++) {
+      int src_idx = y * src->output_width + src_x + i;
+      int tile_idx =
+          wfc__tiles_next(wfc__cell_tiles(src, src_idx), src->tile_words, 0);
+      if (i == tile_i ? !wfc__constrain_tile(wfc, x + i, y, tile_idx)
+                      : !wfc_constrain(wfc, x + i, y,
+                                       src->tiles[tile_idx].image->data))
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int wfc__attempt_job(struct wfc__job *job) {
+  if (!wfc_run(job->wfc, job->max_collapse_cnt)) return 0;
+
+  int winner = atomic_load(job->wfc->winner);
+  while (job->wfc->clone_idx < winner &&
+         !atomic_compare_exchange_weak(job->wfc->winner, &winner,
+                                       job->wfc->clone_idx)) {
+  }
+  return 1;
+}
+
+static int wfc__strip_job(struct wfc__job *job) {
+  return wfc__constrain_region(job, 0, job->wfc->output_width) &&
+         wfc_run(job->wfc, -1);
+}
+
+// Long range structure in the input can leave no way to join the strips
+// across a narrow gap, so the gap grows into the strips until they join,
+// staying clear of the strips' other gaps
+static int wfc__gap_job(struct wfc__job *job) {
+  struct wfc *left = job->left;
+  struct wfc *right = job->right;
+  int margin = job->wfc->tile_width - 1;
+  int gap = job->wfc->output_width - margin * 2;
+  int reach = (left->output_width < right->output_width ? left->output_width
+                                                       : right->output_width) /
+                  2 -
+              margin;
+
+  for (int grow = 0;;) {
+    int width = job->wfc->output_width;
+    // The gap's left margin replaces the strip's last columns and its
+    // right margin is dropped for the strip's, the first column of each
+    // is where the gap meets a strip
+    if (wfc__constrain_border(job->wfc, 0, left,
+                              left->output_width - grow - margin, margin,
+                              0) &&
+        wfc__constrain_border(job->wfc, width - margin, right, grow, margin,
+                              0) &&
+        wfc__constrain_region(job, margin, width - margin) &&
+        wfc_run(job->wfc, -1)) {
+      return 1;
+    }
+    if (grow >= reach) return 0;
+
+    int next = grow ? grow * 2 : gap / 2;
+    if (next > reach) next = reach;
+    struct wfc *wider = wfc__create_instance(
+        job->parent, gap + (next + margin) * 2, job->wfc->output_height,
+        (unsigned int)wfc__rand(job->wfc));
+    if (wider == NULL) return 0;
+
+    wfc__add_stats(&wider->stats, &job->wfc->stats);
+    wfc_destroy(job->wfc);
+    job->wfc = wider;
+    job->x -= next - grow;
+    grow = next;
+  }
+}
+
+// Return 0 on error
+static int wfc__create_clones(struct wfc *wfc, int clone_cnt) {
+  if (wfc->clone_cnt >= clone_cnt) return 1;
+
+  struct wfc **clones = realloc(wfc->clones, sizeof(*clones) * clone_cnt);
+  if (clones == NULL) return 0;
+  wfc->clones = clones;
+
+  while (wfc->clone_cnt < clone_cnt) {
+    struct wfc *clone = wfc__create_instance(wfc, wfc->output_width,
+                                             wfc->output_height, 0);
+    if (clone == NULL) return 0;
+    wfc->clones[wfc->clone_cnt++] = clone;
+  }
+
+  return 1;
+}
+
+// Runs thread_cnt attempts at once, this instance making the first and
+// clones seeded from it the rest, and keeps the lowest numbered attempt
+// that succeeds. Attempts above a success give up early while those
+// below it run to the end, so the output only depends on the seed.
+//
+// Return 0 on error (every attempt failed)
+int wfc_run_parallel(struct wfc *wfc, int max_collapse_cnt, int thread_cnt) {
+  struct wfc__job *jobs = NULL;
+  if (thread_cnt > 1) jobs = malloc(sizeof(*jobs) * thread_cnt);
+  if (jobs == NULL || !wfc__create_clones(wfc, thread_cnt - 1)) {
+    free(jobs);
+    return wfc_run(wfc, max_collapse_cnt);
+  }
+
+  atomic_int winner = thread_cnt;
+  for (int i = 0; i < thread_cnt; i++) {
+    struct wfc *attempt = i ? wfc->clones[i - 1] : wfc;
+    if (i) {
+      if (attempt->backtrack_depth != wfc->backtrack_depth)
+        wfc_set_backtracking(attempt, wfc->backtrack_depth, wfc->max_restarts);
+      attempt->max_restarts = wfc->max_restarts;
+      wfc__copy_state(attempt, wfc);
+      wfc_seed(attempt, (unsigned int)wfc__rand(wfc));
+      memset(&attempt->stats, 0, sizeof(attempt->stats));
+    }
+    attempt->winner = &winner;
+    attempt->clone_idx = i;
+    jobs[i] = (struct wfc__job){.fn = wfc__attempt_job,
+                                .wfc = attempt,
+                                .max_collapse_cnt = max_collapse_cnt};
+  }
+
+  wfc__run_jobs(jobs, thread_cnt);
+
+  for (int i = 0; i < thread_cnt; i++) {
+    struct wfc *attempt = i ? wfc->clones[i - 1] : wfc;
+    attempt->winner = NULL;
+    if (i) wfc__add_stats(&wfc->stats, &attempt->stats);
+  }
+
+  int won = atomic_load(&winner);
+  if (won > 0 && won < thread_cnt) wfc__copy_state(wfc, wfc->clones[won - 1]);
+  free(jobs);
+
+  return won < thread_cnt;
+}
+
+// Splits the output into thread_cnt strips with narrow gaps between them.
+// The strips are generated at once, then the gaps at once with their
+// edges pinned to the strips either side and the tiles where they meet
+// pinned exactly, so every cell's tile is allowed next to its
+// neighbours'.
+//
+// Return 0 on error (a strip or gap had no solution, the output is left
+// as it was)
+int wfc_run_regions(struct wfc *wfc, int thread_cnt) {
+  int margin = wfc->tile_width - 1;
+  int gap = wfc->tile_width * 4;
+
+  // Strips twice as wide as the gaps leave the gaps room to grow
+  int strip_cnt = thread_cnt;
+  while (strip_cnt > 1 &&
+         wfc->output_width - (strip_cnt - 1) * gap < strip_cnt * gap * 2) {
+    strip_cnt--;
+  }
+  if (strip_cnt <= 1) return wfc_run(wfc, -1);
+
+  int rv = 0;
+  int job_cnt = strip_cnt * 2 - 1;
+  struct wfc__job *jobs = calloc(job_cnt, sizeof(*jobs));
+  if (jobs == NULL) {
+    p("wfc_run_regions: error\n");
+    return 0;
+  }
+
+  // Strips first then the gaps, gap i being between strips i and i + 1
+  int strip_space = wfc->output_width - (strip_cnt - 1) * gap;
+  for (int i = 0, x = 0; i < strip_cnt; i++) {
+    int width = strip_space / strip_cnt + (i < strip_space % strip_cnt);
+    jobs[i] = (struct wfc__job){.fn = wfc__strip_job, .parent = wfc, .x = x};
+    jobs[i].wfc = wfc__create_instance(wfc, width, wfc->output_height,
+                                       (unsigned int)wfc__rand(wfc));
+    if (jobs[i].wfc == NULL) goto CLEANUP;
+    x += width + gap;
+  }
+  for (int i = 0; i < strip_cnt - 1; i++) {
+    struct wfc__job *job = &jobs[strip_cnt + i];
+    *job = (struct wfc__job){.fn = wfc__gap_job,
+                             .parent = wfc,
+                             .x = jobs[i + 1].x - gap - margin,
+                             .left = jobs[i].wfc,
+                             .right = jobs[i + 1].wfc};
+    job->wfc = wfc__create_instance(wfc, gap + margin * 2, wfc->output_height,
+                                    (unsigned int)wfc__rand(wfc));
+    if (job->wfc == NULL) goto CLEANUP;
+  }
+
+  wfc__run_jobs(jobs, strip_cnt);
+  for (int i = 0; i < strip_cnt; i++) {
+    if (!jobs[i].rv) goto CLEANUP;
+  }
+
+  wfc__run_jobs(&jobs[strip_cnt], strip_cnt - 1);
+  for (int i = strip_cnt; i < job_cnt; i++) {
+    if (!jobs[i].rv) goto CLEANUP;
+  }
+
+  // Gaps go last as they may have grown over the strips. A gap's left
+  // margin replaces the strip's last columns, whose tiles were never
+  // checked against the gap, its right margin keeps the next strip's
+  for (int i = 0; i < job_cnt; i++) {
+    struct wfc *region = jobs[i].wfc;
+    int border = i < strip_cnt ? 0 : margin;
+    wfc__copy_columns(wfc, jobs[i].x, region, 0,
+                      region->output_width - border);
+  }
+
+  wfc__clear_props(wfc);
+  wfc__clear_decisions(wfc);
+  wfc->collapsed_cell_cnt = wfc->cell_cnt;
+  wfc__heap_build(wfc);
+  // The pins at the seams are what keep this true
+  assert(wfc_broken_rules(wfc) == 0);
+  rv = 1;
+
+CLEANUP:
+  for (int i = 0; i < job_cnt; i++) {
+    if (jobs[i].wfc == NULL) continue;
+    wfc__add_stats(&wfc->stats, &jobs[i].wfc->stats);
+    wfc_destroy(jobs[i].wfc);
+  }
+  free(jobs);
+
+  return rv;
+}
+
+static uint64_t wfc__img_hashregion(struct wfc_image *image,
+                                    enum wfc__direction direction) {
+  struct wfc__region region = wfc__img_region(image, direction);
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (int y = 0; y < region.height; y++) {
+    hash = wfc__fnv1a(hash, wfc__img_region_row(image, region, y),
+                      (size_t)region.width * image->component_cnt);
+  }
+  return hash;
+}
+
+// Tile j can be tile i's neighbour in direction d when i's overlap region
+// in d matches j's in the opposite direction. Every region gets the id of
+// the first region with the same pixels, found through a hash table, and
+// the tiles are listed by the id of each of their regions so the rules
+// come from joining the lists instead of comparing every pair of tiles.
+//
+// Return 0 on error, non-0 on success
+static int wfc__compute_compat(uint64_t *compat[4], struct wfc__tile *tiles,
+                               int tile_cnt, int tile_words) {
+  // Region d of tile i is region i * 4 + d, and a region's id is the
+  // index of the first region with the same pixels
+  int region_cnt = tile_cnt * 4;
+  int slot_cnt = 1;
+  while (slot_cnt < region_cnt * 2) slot_cnt *= 2;
+
+  uint64_t *hashes = malloc(sizeof(*hashes) * region_cnt);
+  int *ids = malloc(sizeof(*ids) * region_cnt);
+  int *heads = malloc(sizeof(*heads) * region_cnt * 4);  // By id * 4 + d
+  int *nexts = malloc(sizeof(*nexts) * region_cnt);      // By region
+  int *slots = malloc(sizeof(*slots) * slot_cnt);
+  if (hashes == NULL || ids == NULL || heads == NULL || nexts == NULL ||
+      slots == NULL) {
+    goto CLEANUP;
+  }
+  memset(heads, -1, sizeof(*heads) * region_cnt * 4);
+  memset(slots, -1, sizeof(*slots) * slot_cnt);
+
+  for (int r = 0; r < region_cnt; r++) {
+    struct wfc_image *image = tiles[r / 4].image;
+    hashes[r] = wfc__img_hashregion(image, r % 4);
+
+    int slot = wfc__hash_mix(hashes[r]) & (slot_cnt - 1);
+    int id;
+    while ((id = slots[slot]) != -1 &&
+           (hashes[id] != hashes[r] ||
+            !wfc__img_cmpregion(image, r % 4, tiles[id / 4].image, id % 4)))
+      slot = (slot + 1) & (slot_cnt - 1);
+    if (id == -1) id = slots[slot] = r;
+    ids[r] = id;
+  }
+
+  // Lists of the tiles whose region d has the id, in tile order
+  for (int r = region_cnt - 1; r >= 0; r--) {
+    int *head = &heads[ids[r] * 4 + r % 4];
+    nexts[r] = *head;
+    *head = r / 4;
+  }
+
+  for (int j = 0; j < tile_cnt; j++) {
+    for (int d = 0; d < 4; d++) {
+      int id = ids[j * 4 + wfc__opposite[d]];
+      for (int i = heads[id * 4 + d]; i != -1; i = nexts[i * 4 + d])
+        wfc__tiles_set(&compat[d][(size_t)i * tile_words], j);
+    }
+  }
+
+  free(hashes);
+  free(ids);
+  free(heads);
+  free(nexts);
+  free(slots);
+
+  return 1;
+
+CLEANUP:
+  p("wfc__compute_compat: error\n");
+  free(hashes);
+  free(ids);
+  free(heads);
+  free(nexts);
+  free(slots);
+  return 0;
+}
+
+// Support counts of a cell with every tile possible: for each direction
+// the number of source tiles enabling each tile
+static void wfc__compute_init_supports(int *init_supports,
+                                       uint64_t *compat[4], int tile_cnt,
+                                       int tile_words) {
+  memset(init_supports, 0, sizeof(*init_supports) * tile_cnt * 4);
   for (int d = 0; d < 4; d++) {
     for (int i = 0; i < tile_cnt; i++) {
-      for (int j = 0; j < tile_cnt; j++) {
-        // if (i==j)
-        //   continue;
-        allowed_tiles[d][i * tile_cnt + j] =
-            wfc__img_cmpoverlap(tiles[i].image, tiles[j].image, d);
+      WFC__FOREACH_TILE(j, &compat[d][(size_t)i * tile_words], tile_words) {
+        init_supports[j * 4 + d]++;
       }
     }
   }
@@ -1035,19 +2300,30 @@ CLEANUP:
   return NULL;
 }
 
+// A wfc with its settings but no tiles or rules yet
+//
 // Return NULL on error
-struct wfc *wfc_overlapping(int output_width, int output_height,
-                            struct wfc_image *image, int tile_width,
-                            int tile_height, int expand_input, int xflip_tiles,
-                            int yflip_tiles, int rotate_tiles) {
+static struct wfc *wfc__create_overlapping(
+    int output_width, int output_height, struct wfc_image *image,
+    int tile_width, int tile_height, int expand_input, int xflip_tiles,
+    int yflip_tiles, int rotate_tiles) {
   struct wfc *wfc = malloc(sizeof(*wfc));
-  if (wfc == NULL) goto CLEANUP;
+  if (wfc == NULL) {
+    p("wfc__create_overlapping: error\n");
+    return NULL;
+  }
 
   wfc->method = WFC_METHOD_OVERLAPPING;
   wfc->image = image;
-  wfc->cells = NULL;
   wfc->tiles = NULL;
-  wfc->props = NULL;
+  wfc->compat[0] = NULL;
+  wfc->init_supports = NULL;
+  wfc->model = NULL;
+  wfc->backtrack_depth = 0;
+  wfc->max_restarts = 0;
+  wfc->decisions = NULL;
+  wfc__null_state(wfc);
+  wfc_seed(wfc, 1641743677);
   wfc->output_width = output_width;
   wfc->output_height = output_height;
   wfc->cell_cnt = output_width * output_height;
@@ -1061,23 +2337,51 @@ struct wfc *wfc_overlapping(int output_width, int output_height,
   // use entropy
   // ...
 
+  return wfc;
+}
+
+// Everything that follows from the tiles and rules
+//
+// Return 0 on error
+static int wfc__finish_overlapping(struct wfc *wfc) {
+  wfc->init_supports = wfc__create_supports(1, wfc->tile_cnt);
+  if (wfc->init_supports == NULL) return 0;
+  wfc__compute_init_supports(wfc->init_supports, wfc->compat, wfc->tile_cnt,
+                             wfc->tile_words);
+
+  wfc->component_cnt = wfc->tiles[0].image->component_cnt;
+  if (!wfc__create_state(wfc)) return 0;
+
+  wfc_init(wfc);
+
+  return 1;
+}
+
+// Return NULL on error
+struct wfc *wfc_overlapping(int output_width, int output_height,
+                            struct wfc_image *image, int tile_width,
+                            int tile_height, int expand_input, int xflip_tiles,
+                            int yflip_tiles, int rotate_tiles) {
+  struct wfc *wfc = wfc__create_overlapping(
+      output_width, output_height, image, tile_width, tile_height,
+      expand_input, xflip_tiles, yflip_tiles, rotate_tiles);
+  if (wfc == NULL) goto CLEANUP;
+
   wfc->tiles = wfc__create_tiles_overlapping(
       wfc->image, wfc->tile_width, wfc->tile_height, wfc->expand_input,
       wfc->xflip_tiles, wfc->yflip_tiles, rotate_tiles, &wfc->tile_cnt);
   if (wfc->tiles == NULL) goto CLEANUP;
 
-  if (!wfc__create_allowed_tiles(wfc->allowed_tiles, wfc->tile_cnt)) {
+  wfc->tile_words = wfc__tile_words(wfc->tile_cnt);
+  if (!wfc__create_compat(wfc->compat, wfc->tile_cnt, wfc->tile_words)) {
+    goto CLEANUP;
+  }
+  if (!wfc__compute_compat(wfc->compat, wfc->tiles, wfc->tile_cnt,
+                           wfc->tile_words)) {
     goto CLEANUP;
   }
-  wfc__compute_allowed_tiles(wfc->allowed_tiles, wfc->tiles, wfc->tile_cnt);
-
-  wfc->cells = wfc__create_cells(wfc->cell_cnt, wfc->tile_cnt);
-  if (wfc->cells == NULL) goto CLEANUP;
-
-  wfc->props = wfc__create_props(wfc->cell_cnt);
-  if (wfc->props == NULL) goto CLEANUP;
 
-  wfc_init(wfc);
+  if (!wfc__finish_overlapping(wfc)) goto CLEANUP;
 
   return wfc;
 
@@ -1087,6 +2391,222 @@ CLEANUP:
   return NULL;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Model cache
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// A compiled model on disk is this header followed by, for each tile, its
+// int32_t frequency and its pixels, then the compat bitsets. Fields are in
+// the byte order of the machine that wrote the file.
+struct wfc__model_header {
+  uint32_t magic;    // WFC__MODEL_MAGIC
+  uint32_t version;  // WFC__MODEL_VERSION
+  uint64_t key;      // wfc__model_key of the image and settings
+  int32_t tile_width;
+  int32_t tile_height;
+  int32_t component_cnt;
+  int32_t tile_cnt;
+};
+
+static const uint32_t WFC__MODEL_MAGIC = 0x4D434657;  // "WFCM"
+static const uint32_t WFC__MODEL_VERSION = 1;  // Bump when tiles or rules
+                                               // would compile differently
+
+// Identifies the model the image and settings compile to, the output size
+// isn't part of it
+static uint64_t wfc__model_key(struct wfc *wfc) {
+  struct wfc_image *image = wfc->image;
+  int32_t settings[] = {(int32_t)WFC__MODEL_VERSION,
+                        image->width,
+                        image->height,
+                        image->component_cnt,
+                        wfc->tile_width,
+                        wfc->tile_height,
+                        !!wfc->expand_input,
+                        !!wfc->xflip_tiles,
+                        !!wfc->yflip_tiles,
+                        !!wfc->rotate_tiles};
+
+  uint64_t key = wfc__fnv1a(0xCBF29CE484222325ULL, settings, sizeof(settings));
+  return wfc__fnv1a(
+      key, image->data,
+      (size_t)image->width * image->height * image->component_cnt);
+}
+
+// Writes to a temporary file renamed over filename once complete, so
+// a reader never sees half a model
+//
+// Return 0 on error
+static int wfc__save_model(struct wfc *wfc, const char *filename) {
+  size_t len = strlen(filename);
+  char *tmp_filename = malloc(len + 5);
+  if (tmp_filename == NULL) goto CLEANUP;
+  memcpy(tmp_filename, filename, len);
+  memcpy(tmp_filename + len, ".tmp", 5);
+
+  FILE *file = fopen(tmp_filename, "wb");
+  if (file == NULL) goto CLEANUP;
+
+  struct wfc__model_header header = {
+      .magic = WFC__MODEL_MAGIC,
+      .version = WFC__MODEL_VERSION,
+      .key = wfc__model_key(wfc),
+      .tile_width = wfc->tile_width,
+      .tile_height = wfc->tile_height,
+      .component_cnt = wfc->component_cnt,
+      .tile_cnt = wfc->tile_cnt,
+  };
+  size_t pixel_len =
+      (size_t)wfc->tile_width * wfc->tile_height * wfc->component_cnt;
+  size_t compat_len = (size_t)wfc->tile_cnt * wfc->tile_words * 4;
+
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (int i = 0; ok && i < wfc->tile_cnt; i++) {
+    int32_t freq = wfc->tiles[i].freq;
+    ok = fwrite(&freq, sizeof(freq), 1, file) == 1 &&
+         fwrite(wfc->tiles[i].image->data, 1, pixel_len, file) == pixel_len;
+  }
+  ok = ok && fwrite(wfc->compat[0], sizeof(*wfc->compat[0]), compat_len,
+                    file) == compat_len;
+  ok = !fclose(file) && ok;
+
+  if (!ok || rename(tmp_filename, filename)) {
+    remove(tmp_filename);
+    goto CLEANUP;
+  }
+
+  free(tmp_filename);
+  return 1;
+
+CLEANUP:
+  p("wfc__save_model: error\n");
+  free(tmp_filename);
+  return 0;
+}
+
+// Return 1 if the rules could have been compiled: no bits past the last
+// tile and every rule mirrored by the one in the opposite direction,
+// 0 otherwise
+static int wfc__compat_valid(uint64_t *compat[4], int tile_cnt,
+                             int tile_words) {
+  uint64_t padding = tile_cnt % 64 ? ~0ULL << (tile_cnt % 64) : 0;
+  for (int d = 0; d < 4; d++) {
+    for (int i = 0; i < tile_cnt; i++) {
+      uint64_t *tiles = &compat[d][(size_t)i * tile_words];
+      if (tiles[tile_words - 1] & padding) return 0;
+
+      uint64_t *opposite = compat[wfc__opposite[d]];
+      WFC__FOREACH_TILE(j, tiles, tile_words) {
+        if (!wfc__tiles_get(&opposite[(size_t)j * tile_words], i)) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Reads the tiles and rules if the file holds the model of the wfc's
+// image and settings
+//
+// Return 0 on error (no such file, a different model or a bad one)
+static int wfc__load_model(struct wfc *wfc, const char *filename) {
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) return 0;
+
+  struct wfc__model_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != WFC__MODEL_MAGIC ||
+      header.version != WFC__MODEL_VERSION ||
+      header.key != wfc__model_key(wfc) ||
+      header.tile_width != wfc->tile_width ||
+      header.tile_height != wfc->tile_height ||
+      header.component_cnt != wfc->image->component_cnt ||
+      header.tile_cnt <= 0)
+    goto CLEANUP;
+
+  // The size has to match before anything is allocated for the tiles
+  size_t pixel_len =
+      (size_t)header.tile_width * header.tile_height * header.component_cnt;
+  size_t compat_len =
+      (size_t)header.tile_cnt * wfc__tile_words(header.tile_cnt) * 4;
+  long expected = sizeof(header) +
+                  (sizeof(int32_t) + pixel_len) * header.tile_cnt +
+                  sizeof(*wfc->compat[0]) * compat_len;
+  if (fseek(file, 0, SEEK_END) || ftell(file) != expected ||
+      fseek(file, sizeof(header), SEEK_SET))
+    goto CLEANUP;
+
+  wfc->tiles = wfc__create_tiles(header.tile_cnt);
+  if (wfc->tiles == NULL) goto CLEANUP;
+  wfc->tile_cnt = header.tile_cnt;
+  wfc->tile_words = wfc__tile_words(wfc->tile_cnt);
+
+  for (int i = 0; i < wfc->tile_cnt; i++) {
+    int32_t freq;
+    struct wfc_image *image = wfc_img_create(
+        header.tile_width, header.tile_height, header.component_cnt);
+    wfc->tiles[i].image = image;
+    if (image == NULL || fread(&freq, sizeof(freq), 1, file) != 1 ||
+        fread(image->data, 1, pixel_len, file) != pixel_len || freq <= 0)
+      goto CLEANUP;
+    wfc->tiles[i].freq = freq;
+  }
+
+  if (!wfc__create_compat(wfc->compat, wfc->tile_cnt, wfc->tile_words) ||
+      fread(wfc->compat[0], sizeof(*wfc->compat[0]), compat_len, file) !=
+          compat_len ||
+      !wfc__compat_valid(wfc->compat, wfc->tile_cnt, wfc->tile_words))
+    goto CLEANUP;
+
+  fclose(file);
+  return 1;
+
+CLEANUP:
+  p("wfc__load_model: %s holds no usable model\n", filename);
+  fclose(file);
+  wfc__destroy_tiles(wfc->tiles, wfc->tile_cnt);
+  wfc__destroy_compat(wfc->compat);
+  wfc->tiles = NULL;
+  wfc->tile_cnt = 0;
+  wfc->compat[0] = NULL;
+  return 0;
+}
+
+// Like wfc_overlapping, but the tiles and rules come from the model file
+// when it holds the ones the image and settings compile to. Otherwise
+// they're compiled and written to the file for next time. The output
+// size isn't part of the model so one file serves any output size.
+//
+// Return NULL on error
+struct wfc *wfc_overlapping_cached(int output_width, int output_height,
+                                   struct wfc_image *image, int tile_width,
+                                   int tile_height, int expand_input,
+                                   int xflip_tiles, int yflip_tiles,
+                                   int rotate_tiles, const char *filename) {
+  struct wfc *wfc = wfc__create_overlapping(
+      output_width, output_height, image, tile_width, tile_height,
+      expand_input, xflip_tiles, yflip_tiles, rotate_tiles);
+  if (wfc == NULL) return NULL;
+
+  if (!wfc__load_model(wfc, filename)) {
+    wfc_destroy(wfc);
+    wfc = wfc_overlapping(output_width, output_height, image, tile_width,
+                          tile_height, expand_input, xflip_tiles,
+                          yflip_tiles, rotate_tiles);
+    if (wfc != NULL) wfc__save_model(wfc, filename);
+    return wfc;
+  }
+
+  if (!wfc__finish_overlapping(wfc)) {
+    p("wfc_overlapping_cached: error\n");
+    wfc_destroy(wfc);
+    return NULL;
+  }
+
+  return wfc;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Code graveyard
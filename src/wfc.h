@@ -40,11 +40,54 @@
 // The output image will have the same number of components as the input
 // image.
 //
+// Cutting the input into tiles and working out which may go next to
+// each other takes a while for large inputs. wfc_overlapping_cached does
+// it once and keeps the result in a file, keyed by the input image and
+// the tile settings, that later calls load instead:
+//
+//         struct wfc *wfc = wfc_overlapping_cached(
+//             128, 128, input_image, 3, 3, 1, 1, 1, 1, "input.wfc");
+//
 // wfc_run returns 0 if it cannot find a solution. You can try again like so:
 //
 //         wfc_init(wfc);
 //         wfc_run(wfc, -1);
 //
+// Or let wfc_run recover from contradictions itself by undoing up to the
+// last 64 collapses and, failing that, starting over up to 8 times:
+//
+//         wfc_set_backtracking(wfc, 64, 8);
+//         wfc_run(wfc, -1);
+//         struct wfc_stats stats = wfc_get_stats(wfc);
+//
+// Output pixels can be pinned before running, e.g. to the border of an
+// already generated neighbouring region so the two join seamlessly:
+//
+//         wfc_init(wfc);
+//         wfc_constrain(wfc, x, y, pixel);  // 0 if the pins contradict
+//         wfc_run(wfc, -1);
+//
+// Each wfc has its own random numbers, the same seed gives the same
+// output, and different instances can run on different threads:
+//
+//         wfc_seed(wfc, 1234);
+//
+// Runs can be spread over threads in two ways. Several attempts at once,
+// keeping the lowest numbered that succeeds so the output still only
+// depends on the seed, which helps when contradictions are common:
+//
+//         wfc_run_parallel(wfc, -1, 4);
+//
+// Or side by side strips generated at once and joined by narrow gaps
+// generated afterwards, which helps with large outputs:
+//
+//         wfc_run_regions(wfc, 4);
+//
+// Either way the cells' tiles are all allowed next to each other, which
+// can be checked for any run:
+//
+//         assert(wfc_broken_rules(wfc) == 0);
+//
 //
 // Working with image files
 // ----------------------------------------
@@ -104,6 +147,15 @@ struct wfc_image {
   int height;
 };
 
+// Counters of the work done since wfc_init
+struct wfc_stats {
+  int decisions;         // Cells collapsed by a random pick
+  int backtracks;        // Decisions undone after a contradiction
+  int restarts;          // Runs started over from scratch
+  int wasted_decisions;  // Decisions thrown away by backtracks and restarts
+  long wasted_bans;      // Tile bans thrown away by backtracks and restarts
+};
+
 struct wfc *wfc_overlapping(
     int output_width,         // Output width in pixels
     int output_height,        // Output height in pixels
@@ -115,10 +167,35 @@ struct wfc *wfc_overlapping(
     int yflip_tiles,          // Add yflips of all tiles
     int rotate_tiles);        // Add n*90deg rotations of all tiles
 
+struct wfc *wfc_overlapping_cached(
+    int output_width, int output_height, struct wfc_image *image,
+    int tile_width, int tile_height, int expand_input, int xflip_tiles,
+    int yflip_tiles, int rotate_tiles,
+    const char *filename);  // Compiled tiles and rules, written if missing
+                            // or out of date
+
 struct wfc_image *wfc_img_load(const char *filename);
 void wfc_init(
     struct wfc *wfc);  // Resets wfc generation, wfc_run can be called again
 int wfc_run(struct wfc *wfc, int max_collapse_cnt);
+int wfc_run_parallel(struct wfc *wfc, int max_collapse_cnt,
+                     int thread_cnt);  // Attempts run at once
+int wfc_run_regions(struct wfc *wfc,
+                    int thread_cnt);  // Strips generated at once
+void wfc_seed(struct wfc *wfc, unsigned int seed);
+int wfc_set_backtracking(
+    struct wfc *wfc,
+    int depth,          // Most recent collapses that can be undone, 0 = off
+    int max_restarts);  // Restarts after backtracking fails
+struct wfc_stats wfc_get_stats(struct wfc *wfc);
+int wfc_broken_rules(
+    struct wfc *wfc);  // Neighbouring collapsed cells whose tiles the
+                       // rules don't allow side by side
+int wfc_constrain(
+    struct wfc *wfc,
+    int x,                        // Output pixel to pin
+    int y,                        //
+    const unsigned char *pixel);  // component_cnt components
 struct wfc_image *wfc_output_image(struct wfc *wfc);
 int wfc_export(struct wfc *wfc, const char *filename);
 